@@ -293,6 +293,10 @@ static void ahttpd_state_free(struct ahttpd_state *state) {
 
     ESP_LOGD(TAG, "Freeing state for request url: %s", url);
 
+    if (state->request->on_close != NULL) {
+        state->request->on_close(state->request);
+    }
+
     if (state->request->headers != NULL) {
         struct ahttpd_header *header;
         while ((header = state->request->headers) != NULL) {
@@ -714,15 +718,33 @@ esp_err_t ahttpd_stop(struct ahttpd *httpd) {
 }
 
 
+static const char *ahttpd_reason(uint16_t code) {
+    switch (code) {
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 416: return "Range Not Satisfiable";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        default: return "OK";
+    }
+}
+
+
 void ahttpd_start_response(struct ahttpd_request *request, uint16_t code) {
     struct ahttpd_state *state = (struct ahttpd_state *)request->_state;
-    char buf[32];
+    char buf[48];
 
     if (state == NULL) {
         return;
     }
 
-    snprintf(buf, sizeof(buf), "HTTP/1.1 %" PRIu16 " OK\r\n", code);
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %" PRIu16 " %s\r\n", code,
+             ahttpd_reason(code));
     ahttpd_write(state, state->pcb, buf, strlen(buf));
 }
 
@@ -72,6 +72,10 @@ struct ahttpd_request {
     void *data;
     /* flag to call free on data pointer */
     uint8_t free_data;
+    /* called once the connection is done with the request, whether it was
+       completed, errored or aborted by the client, to release whatever the
+       handler keeps in data/state. Nothing may be sent from it */
+    void (*on_close)(struct ahttpd_request *);
     /* state pointer for application use */
     void *state;
 
@@ -36,8 +36,15 @@
     AHTTPD_FS_URL(routes, "*")
 
 
+#define AHTTPD_FS_TRACE_URL(routes, url) \
+    AHTTPD_ROUTE(routes, AHTTPD_GET, url, &(ahttpd_fs_trace_handler), NULL)
+
+
 enum ahttpd_status ahttpd_fs_handler(struct ahttpd_request *request);
 
+/* Needs CONFIG_AHTTPD_ESPFS_TRACE_SIZE, the body is empty without */
+enum ahttpd_status ahttpd_fs_trace_handler(struct ahttpd_request *request);
+
 void ahttpd_fs_501_handler(
         enum ahttpd_status (*handler)(struct ahttpd_request *));
 
@@ -23,12 +23,16 @@ ifdef CONFIG_AHTTPD_ENABLE_ESPFS
 COMPONENT_ADD_LDFLAGS += -lwebpages-espfs
 CFLAGS += -DCONFIG_AHTTPD_ENABLE_ESPFS
 CFLAGS += -DAHTTPD_ESPFS_CHUNK_SIZE=$(CONFIG_AHTTPD_ESPFS_CHUNK_SIZE)
+CFLAGS += -DAHTTPD_ESPFS_INLINE_SIZE=$(CONFIG_AHTTPD_ESPFS_INLINE_SIZE)
+CFLAGS += -DESPFS_POOL_SIZE=$(CONFIG_AHTTPD_ESPFS_MAX_OPEN_FILES)
+CFLAGS += -DESPFS_TRACE_SIZE=$(CONFIG_AHTTPD_ESPFS_TRACE_SIZE)
 COMPONENT_EXTRA_CLEAN := \
 	libwebpages-espfs.a \
 	webpages.espfs \
 	webpages.espfs.o \
 	webpages.espfs.o.tmp \
-	mkespfsimage/heatshrink_encoder.o \
+	mkespfsimage/heatshrink_decoder.o \
+	mkespfsimage/lz4.o \
 	mkespfsimage/main.o \
 	mkespfsimage/mkespfsimage
 
@@ -44,21 +48,97 @@ endif  # CONFIG_AHTTPD_HTML_GENERATE_CMD
 
 
 ifdef CONFIG_AHTTPD_ESPFS_GZIP
-GZIP_FILES := $(shell echo "-g" $(CONFIG_AHTTPD_ESPFS_GZIP_EXTS))
+GZIP_FILES := $(shell echo "-g" $(CONFIG_AHTTPD_ESPFS_GZIP_EXTS) \
+	"-w" $(CONFIG_AHTTPD_ESPFS_GZIP_WINDOW_BITS))
 GZIP_COMPRESSION := "yes"
+ifdef CONFIG_AHTTPD_ESPFS_VARIANTS
+ifdef CONFIG_AHTTPD_ESPFS_BROTLI
+GZIP_FILES += -e gzip,br
+BROTLI_COMPRESSION := "yes"
+else
+GZIP_FILES += -e gzip
+BROTLI_COMPRESSION := "no"
+endif  # CONFIG_AHTTPD_ESPFS_BROTLI
+endif  # CONFIG_AHTTPD_ESPFS_VARIANTS
+ifdef CONFIG_AHTTPD_ESPFS_GUNZIP
+CFLAGS += -DESPFS_GUNZIP
+COMPONENT_SRCDIRS += espfs/gunzip
+endif  # CONFIG_AHTTPD_ESPFS_GUNZIP
 else
 GPIZ_FILES :=
 GZIP_COMPRESSION := "no"
+BROTLI_COMPRESSION := "no"
 endif  # CONFIG_AHTTPD_ESPFS_GZIP
 
 
 ifdef CONFIG_AHTTPD_ESPFS_HEATSHRINK
 USE_HEATSHRINK := "yes"
 CFLAGS += -DESPFS_HEATSHRINK
+CFLAGS += -DESPFS_HEATSHRINK_INPUT_SIZE=$(CONFIG_AHTTPD_ESPFS_HEATSHRINK_INPUT_SIZE)
+CFLAGS += -DESPFS_POOL_WINDOW_BITS=$(CONFIG_AHTTPD_ESPFS_POOL_WINDOW_BITS)
+CFLAGS += -DESPFS_CACHE_SIZE=$(CONFIG_AHTTPD_ESPFS_CACHE_SIZE)
+CFLAGS += -DESPFS_CACHE_ENTRIES=$(CONFIG_AHTTPD_ESPFS_CACHE_ENTRIES)
 COMPONENT_SRCDIRS += espfs/heatshrink
+BLOCK_SIZE := $(shell echo "-b" $(CONFIG_AHTTPD_ESPFS_HEATSHRINK_BLOCK_SIZE) \
+	"-d" $(CONFIG_AHTTPD_ESPFS_HEATSHRINK_DICTIONARY))
 else
 USE_HEATSHRINK := "no"
+BLOCK_SIZE :=
+endif  # CONFIG_AHTTPD_ESPFS_HEATSHRINK
+
+
+ifdef CONFIG_AHTTPD_ESPFS_LZ4
+CFLAGS += -DESPFS_LZ4
+COMPONENT_SRCDIRS += espfs/lz4
+LZ4 := $(shell echo "-B" $(CONFIG_AHTTPD_ESPFS_LZ4_BLOCK_SIZE))
+ifdef CONFIG_AHTTPD_ESPFS_HEATSHRINK
+LZ4 += $(shell echo "-f" $(CONFIG_AHTTPD_ESPFS_LZ4_SLACK))
+else
+LZ4 += -c 2
 endif  # CONFIG_AHTTPD_ESPFS_HEATSHRINK
+else
+LZ4 :=
+endif  # CONFIG_AHTTPD_ESPFS_LZ4
+
+
+ifdef CONFIG_AHTTPD_ESPFS_TUNE
+TUNE := -O
+ifdef CONFIG_AHTTPD_ESPFS_HEATSHRINK
+TUNE += $(shell echo "-r" $(CONFIG_AHTTPD_ESPFS_TUNE_RAM))
+endif  # CONFIG_AHTTPD_ESPFS_HEATSHRINK
+else
+TUNE :=
+endif  # CONFIG_AHTTPD_ESPFS_TUNE
+
+
+ALIASES :=
+ifneq ($(CONFIG_AHTTPD_ESPFS_INDEX),"")
+ALIASES += $(shell echo "-i" $(CONFIG_AHTTPD_ESPFS_INDEX))
+endif
+ifneq ($(CONFIG_AHTTPD_ESPFS_FALLBACK),"")
+ALIASES += $(shell echo "-s" $(CONFIG_AHTTPD_ESPFS_FALLBACK))
+endif
+ifdef CONFIG_AHTTPD_ESPFS_PREBAKED_HEADERS
+ALIASES += -H
+endif
+ifneq ($(CONFIG_AHTTPD_ESPFS_LAYOUT_TRACE),"")
+ALIASES += $(shell echo "-t" $(PROJECT_PATH)/$(CONFIG_AHTTPD_ESPFS_LAYOUT_TRACE))
+endif
+ifdef CONFIG_AHTTPD_ESPFS_FINGERPRINT
+ALIASES += -F
+endif
+ifdef CONFIG_AHTTPD_ESPFS_MINIFY
+ALIASES += -M
+endif
+ifneq ($(CONFIG_AHTTPD_ESPFS_INLINE_ASSET_SIZE),0)
+ALIASES += $(shell echo "-I" $(CONFIG_AHTTPD_ESPFS_INLINE_ASSET_SIZE))
+endif
+ifneq ($(CONFIG_AHTTPD_ESPFS_SERVICE_WORKER),"")
+ALIASES += $(shell echo "-W" $(CONFIG_AHTTPD_ESPFS_SERVICE_WORKER))
+endif
+ifneq ($(CONFIG_AHTTPD_ESPFS_MANIFEST),"")
+ALIASES += $(shell echo "-m" $(PROJECT_PATH)/$(CONFIG_AHTTPD_ESPFS_MANIFEST))
+endif
 
 
 libahttpd.a: libwebpages-espfs.a
@@ -67,7 +147,9 @@ webpages.espfs: $(PROJECT_PATH)/$(CONFIG_AHTTPD_HTMLDIR) mkespfsimage/mkespfsima
 	cd $(PROJECT_PATH)/$(CONFIG_AHTTPD_HTMLDIR) && \
 		pwd && \
 		find . | $(COMPONENT_BUILD_DIR)/mkespfsimage/mkespfsimage \
-					$(GZIP_FILES) > $(COMPONENT_BUILD_DIR)/webpages.espfs
+					$(GZIP_FILES) $(BLOCK_SIZE) $(LZ4) $(TUNE) $(ALIASES) \
+					-C $(COMPONENT_BUILD_DIR)/mkespfsimage/cache \
+					> $(COMPONENT_BUILD_DIR)/webpages.espfs
 
 libwebpages-espfs.a: webpages.espfs
 	$(OBJCOPY) -I binary -O elf32-xtensa-le -B xtensa --rename-section \
@@ -82,6 +164,7 @@ mkespfsimage/mkespfsimage: $(COMPONENT_PATH)/espfs/mkespfsimage
 			-f $(COMPONENT_PATH)/espfs/mkespfsimage/Makefile \
 				USE_HEATSHRINK="$(USE_HEATSHRINK)" \
 				GZIP_COMPRESSION="$(GZIP_COMPRESSION)" \
+				BROTLI_COMPRESSION="$(BROTLI_COMPRESSION)" \
 				BUILD_DIR=$(COMPONENT_BUILD_DIR)/mkespfsimage \
 				CC=$(HOSTCC)
 
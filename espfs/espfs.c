@@ -31,17 +31,87 @@ It's written for use with httpd, but doesn't need to be used as such.
 #define ICACHE_FLASH_ATTR
 #endif
 
+#if defined(ESP_PLATFORM) && !defined(CONFIG_IDF_TARGET_LINUX)
+#include "esp_partition.h"
+#endif
+
+#if !(__ets__ || ESP_PLATFORM) || defined(CONFIG_IDF_TARGET_LINUX)
+//Host builds mount image files
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifndef ESPFS_TRACE_SIZE
+#define ESPFS_TRACE_SIZE 0
+#endif
+
+#if ESPFS_TRACE_SIZE > 0
+#if defined(ESP_PLATFORM) && !defined(CONFIG_IDF_TARGET_LINUX)
+#include "esp_timer.h"
+#elif !(__ets__ || ESP_PLATFORM) || defined(CONFIG_IDF_TARGET_LINUX)
+#include <time.h>
+#endif
+#endif
+
 #include "espfsformat.h"
 #include "espfs.h"
 
 #ifdef ESPFS_HEATSHRINK
 #include "heatshrink/heatshrink_config.h"
 #include "heatshrink/heatshrink_decoder.h"
+
+//Bytes of compressed data the decoder takes per sink; every sink is followed by one poll.
+#ifndef ESPFS_HEATSHRINK_INPUT_SIZE
+#define ESPFS_HEATSHRINK_INPUT_SIZE 256
+#endif
+#endif
+
+#ifdef ESPFS_GUNZIP
+#include "gunzip/gunzip.h"
+
+//Not a compression type of the image: a FLAG_GZIP file that is inflated while reading it.
+#define DECOMPRESS_GUNZIP 0x7f
+#endif
+
+#ifdef ESPFS_LZ4
+#include "lz4/lz4.h"
+
+//An LZ4 file needs a buffer of its block size to decode into; bigger blocks are refused.
+#ifndef ESPFS_LZ4_MAX_BLOCK_SIZE
+#define ESPFS_LZ4_MAX_BLOCK_SIZE 16384
+#endif
+#endif
+
+
+//Several images can be mounted at once, each in its own layer; a file in a higher layer hides
+//files of the same name in the layers below. Layer 0 is the image espFsInit mounts.
+#ifndef ESPFS_MAX_IMAGES
+#define ESPFS_MAX_IMAGES 4
 #endif
 
+typedef struct EspFsImage EspFsImage;
 
-//ESP8266 stores flash offsets here. ESP32, for now, stores memory locations here.
-static char* espFsData = NULL;
+
+//Fully decoded copies of heatshrink files are kept in RAM while they fit in ESPFS_CACHE_SIZE
+//bytes, so the files every client requests are decoded once instead of for every request.
+#ifndef ESPFS_CACHE_SIZE
+#define ESPFS_CACHE_SIZE 0
+#endif
+
+#ifndef ESPFS_CACHE_ENTRIES
+#define ESPFS_CACHE_ENTRIES 8
+#endif
+
+#if !defined(ESPFS_HEATSHRINK) && ESPFS_CACHE_SIZE > 0
+#undef ESPFS_CACHE_SIZE
+#define ESPFS_CACHE_SIZE 0
+#endif
+
+#if ESPFS_CACHE_SIZE > 0
+typedef struct EspFsCacheEntry EspFsCacheEntry;
+#endif
 
 
 struct EspFsFile {
@@ -50,8 +120,38 @@ struct EspFsFile {
 	int32_t posDecomp;
 	char *posStart;
 	char *posComp;
+	int32_t fileLenComp; //cached from the header
+	int32_t fileLenDecomp;
 	void *decompData;
+	const int32_t *blocks; //restart offsets of a block-compressed file, or NULL
+	int32_t blockSize;
+	int32_t blockEnd; //decompressed position where the current block ends (LZ4: the decoded one, or 0)
+	char *blockEndComp; //end of the compressed data of the current block
+	EspFsImage *image; //the file lives in, kept around until the file is closed
+#if ESPFS_CACHE_SIZE > 0
+	EspFsCacheEntry *cache; //decoded copy this file reads from
+#endif
+#ifdef ESPFS_HEATSHRINK
+	char *dict; //data the decoder window is primed with, or NULL
+	int32_t dictLen;
+#endif
+};
+
+
+#if ESPFS_CACHE_SIZE > 0
+//A copy is filled by its own decoder as far as its readers need it, so clients that request a
+//file at the same time share one decode, each reading at its own pace.
+struct EspFsCacheEntry {
+	EspFsHeader *header; //image entry the data belongs to, NULL if the slot is unused
+	uint32_t generation; //of the image; an image mounted at the same address gets a new one
+	char *data;
+	int32_t len;
+	int32_t filled; //bytes decoded so far
+	EspFsFile src; //decodes into data until filled reaches len
+	uint8_t referenced; //CLOCK bit, set on every hit
+	uint8_t users; //open files reading from data
 };
+#endif
 
 
 struct EspFs {
@@ -62,7 +162,228 @@ struct EspFs {
 };
 
 
-static struct EspFs *_fs = NULL;
+struct EspFsImage {
+	char *data; //ESP8266 stores flash offsets here. ESP32, for now, stores memory locations here.
+	size_t len; //bytes mapped at data, 0 if unknown
+	struct EspFs *index;
+	char *fallback; //entry unknown paths resolve to, or NULL
+	uint32_t generation;
+	int users; //open files, and lookups in progress
+	int mounted;
+	void (*release)(void *arg); //called once the image is unmounted and unused
+	void *arg;
+};
+
+
+static EspFsImage *espFsImages[ESPFS_MAX_IMAGES];
+static uint32_t espFsGeneration = 0;
+
+//Mounting may happen from another task than the one serving files.
+#ifdef ESP_PLATFORM
+static portMUX_TYPE espFsMux = portMUX_INITIALIZER_UNLOCKED;
+#define ESPFS_LOCK() portENTER_CRITICAL(&espFsMux)
+#define ESPFS_UNLOCK() portEXIT_CRITICAL(&espFsMux)
+#else
+#define ESPFS_LOCK()
+#define ESPFS_UNLOCK()
+#endif
+
+
+//File handles, and heatshrink decoders for windows up to ESPFS_POOL_WINDOW_BITS, come out of a
+//static pool so serving many files at once doesn't fragment the heap. Once the pool is exhausted
+//(or for larger windows) they are malloc'd like before. Like the rest of espfs this is not
+//thread safe; files are opened and read from the httpd task only.
+#ifndef ESPFS_POOL_SIZE
+#define ESPFS_POOL_SIZE 4
+#endif
+
+#ifndef ESPFS_POOL_WINDOW_BITS
+#define ESPFS_POOL_WINDOW_BITS 11
+#endif
+
+#if ESPFS_POOL_SIZE > 0
+typedef struct {
+	EspFsFile file;
+#ifdef ESPFS_HEATSHRINK
+	//Room for a heatshrink_decoder and its input and window buffers
+	uint32_t decoder[(sizeof(heatshrink_decoder) + ESPFS_HEATSHRINK_INPUT_SIZE +
+			(1 << ESPFS_POOL_WINDOW_BITS) + 3) / 4];
+#endif
+} EspFsSlot;
+
+static EspFsSlot espFsPool[ESPFS_POOL_SIZE];
+static EspFsSlot *espFsFreeSlots[ESPFS_POOL_SIZE]; //stack of returned slots
+static int espFsFreeCount = 0;
+static int espFsPoolUsed = 0; //slots handed out at least once
+
+static EspFsSlot ICACHE_FLASH_ATTR *espFsSlotGet(void) {
+	if (espFsFreeCount > 0) {
+		return espFsFreeSlots[--espFsFreeCount];
+	}
+	if (espFsPoolUsed < ESPFS_POOL_SIZE) {
+		return &espFsPool[espFsPoolUsed++];
+	}
+	return NULL;
+}
+
+static int ICACHE_FLASH_ATTR espFsInPool(const void *p) {
+	return (const char *)p >= (const char *)espFsPool &&
+			(const char *)p < (const char *)&espFsPool[ESPFS_POOL_SIZE];
+}
+#endif
+
+//Returns a file handle from the pool, or a malloc'd one if the pool is exhausted.
+static EspFsFile ICACHE_FLASH_ATTR *espFsFileGet(void) {
+#if ESPFS_POOL_SIZE > 0
+	EspFsSlot *slot = espFsSlotGet();
+	if (slot != NULL) {
+		return &slot->file;
+	}
+#endif
+	return malloc(sizeof(EspFsFile));
+}
+
+static void ICACHE_FLASH_ATTR espFsFilePut(EspFsFile *fh) {
+#if ESPFS_POOL_SIZE > 0
+	if (espFsInPool(fh)) {
+		espFsFreeSlots[espFsFreeCount++] = (EspFsSlot *)fh;
+		return;
+	}
+#endif
+	free(fh);
+}
+
+#if ESPFS_CACHE_SIZE > 0
+static EspFsCacheEntry espFsCache[ESPFS_CACHE_ENTRIES];
+static int32_t espFsCacheUsed = 0; //bytes
+static int espFsCacheHand = 0;
+
+static void ICACHE_FLASH_ATTR espFsCacheFree(EspFsCacheEntry *e) {
+	if (e->src.decompData != NULL) {
+		heatshrink_decoder_free((heatshrink_decoder *)e->src.decompData);
+	}
+	free(e->data);
+	espFsCacheUsed -= e->len;
+	memset(e, 0, sizeof(EspFsCacheEntry));
+}
+
+//Evict entries nobody is reading until len more bytes fit, CLOCK style: an entry that was hit
+//since the hand last passed gets another round. Returns a free slot, or NULL if there is no room.
+static EspFsCacheEntry ICACHE_FLASH_ATTR *espFsCacheEvict(int32_t len) {
+	EspFsCacheEntry *e, *slot = NULL;
+	int i;
+
+	for (i = 0; i < 2 * ESPFS_CACHE_ENTRIES; i++) {
+		if (slot != NULL && espFsCacheUsed + len <= ESPFS_CACHE_SIZE) {
+			return slot;
+		}
+
+		e = &espFsCache[espFsCacheHand];
+		espFsCacheHand = (espFsCacheHand + 1) % ESPFS_CACHE_ENTRIES;
+		if (e->header != NULL) {
+			if (e->users > 0) {
+				continue;
+			}
+			if (e->referenced) {
+				e->referenced = 0;
+				continue;
+			}
+			espFsCacheFree(e);
+		}
+		if (slot == NULL) {
+			slot = e;
+		}
+	}
+
+	return (slot != NULL && espFsCacheUsed + len <= ESPFS_CACHE_SIZE) ? slot : NULL;
+}
+
+//Hook a heatshrink file up to its decoded copy, complete or still being decoded for another
+//reader, or start a new one if it is read from the start.
+static void ICACHE_FLASH_ATTR espFsCacheAttach(EspFsFile *fh) {
+	EspFsCacheEntry *e;
+	int i;
+
+	for (i = 0; i < ESPFS_CACHE_ENTRIES; i++) {
+		e = &espFsCache[i];
+		if (e->header == fh->header && e->generation == fh->image->generation) {
+			if (e->users == 0xff) {
+				return;
+			}
+			e->referenced = 1;
+			e->users++;
+			fh->cache = e;
+			return;
+		}
+	}
+
+	if (fh->posDecomp != 0 || fh->fileLenDecomp > ESPFS_CACHE_SIZE) {
+		return;
+	}
+
+	e = espFsCacheEvict(fh->fileLenDecomp);
+	if (e == NULL) {
+		return;
+	}
+
+	e->data = malloc(fh->fileLenDecomp);
+	if (e->data == NULL) {
+		return;
+	}
+	e->header = fh->header;
+	e->generation = fh->image->generation;
+	e->len = fh->fileLenDecomp;
+	e->filled = 0;
+	e->src = *fh;
+	e->referenced = 0;
+	e->users = 1;
+	espFsCacheUsed += e->len;
+	fh->cache = e;
+}
+
+static void ICACHE_FLASH_ATTR espFsCacheDetach(EspFsFile *fh) {
+	EspFsCacheEntry *e = fh->cache;
+	if (e == NULL) {
+		return;
+	}
+
+	e->users--;
+	if (e->users == 0 && e->filled < e->len) {
+		//Nobody is going to finish decoding it.
+		espFsCacheFree(e);
+	}
+	fh->cache = NULL;
+}
+#endif
+
+#ifdef ESPFS_HEATSHRINK
+//Returns a heatshrink decoder for fh, using the room in its pool slot when the window fits.
+static heatshrink_decoder ICACHE_FLASH_ATTR *espFsDecoderGet(EspFsFile *fh, uint8_t window,
+		uint8_t lookahead) {
+#if ESPFS_POOL_SIZE > 0
+	if (espFsInPool(fh) && window >= HEATSHRINK_MIN_WINDOW_BITS && window <= ESPFS_POOL_WINDOW_BITS &&
+			lookahead >= HEATSHRINK_MIN_LOOKAHEAD_BITS && lookahead < window) {
+		//Same setup heatshrink_decoder_alloc does, minus the allocation
+		heatshrink_decoder *dec = (heatshrink_decoder *)((EspFsSlot *)fh)->decoder;
+		dec->input_buffer_size = ESPFS_HEATSHRINK_INPUT_SIZE;
+		dec->window_sz2 = window;
+		dec->lookahead_sz2 = lookahead;
+		heatshrink_decoder_reset(dec);
+		return dec;
+	}
+#endif
+	return heatshrink_decoder_alloc(ESPFS_HEATSHRINK_INPUT_SIZE, window, lookahead);
+}
+
+static void ICACHE_FLASH_ATTR espFsDecoderPut(heatshrink_decoder *dec) {
+#if ESPFS_POOL_SIZE > 0
+	if (espFsInPool(dec)) {
+		return;
+	}
+#endif
+	heatshrink_decoder_free(dec);
+}
+#endif
 
 
 /*
@@ -104,26 +425,106 @@ void ICACHE_FLASH_ATTR readFlashAligned(uint32 *dst, uint32_t pos, int len) {
 	spi_flash_read(pos, dst, len);
 }
 #else
-#define readFlashAligned(a,b,c) memcpy(a, (uint32_t*)b, c)
+#define readFlashAligned(a,b,c) memcpy(a, (uint32_t*)(b), c)
 #endif
 
 
-static void freeEspFS(void) {
-    struct EspFs *f;
-    while ((f = _fs) != NULL) {
-        _fs = _fs->next;
+static void freeEspFS(struct EspFs *f) {
+    struct EspFs *next;
+    while (f != NULL) {
+        next = f->next;
         free(f->name);
         free(f);
+        f = next;
     }
 }
 
 
-static void scanEspFS(void) {
-	if (_fs != NULL) {
-        return;
+//Whether the len bytes at p lie within the image. Without a known length (the image linked into
+//the firmware) they're taken to.
+static int ICACHE_FLASH_ATTR espFsFits(EspFsImage *img, char *p, size_t len) {
+	size_t off;
+
+	if (img->len == 0) {
+		return 1;
 	}
+	if ((uintptr_t)p < (uintptr_t)img->data) {
+		return 0;
+	}
+	off = (uintptr_t)p - (uintptr_t)img->data;
+	return off <= img->len && len <= img->len - off;
+}
+
+
+//Whether there is a sane entry at p: its header, name, attributes and data within the image,
+//so a truncated or corrupt image is never walked past its end.
+static int ICACHE_FLASH_ATTR espFsEntryOk(EspFsImage *img, char *p) {
+	EspFsHeader h;
+	EspFsAttr a;
+	char *attr, *end;
 
-	char *p = espFsData;
+	if (img->len == 0) {
+		return 1;
+	}
+	if ((((uintptr_t)p - (uintptr_t)img->data) & 3) != 0 || !espFsFits(img, p, sizeof(EspFsHeader))) {
+		return 0;
+	}
+	readFlashAligned((uint32_t *)&h, (uintptr_t)p, sizeof(EspFsHeader));
+	if (h.magic != ESPFS_MAGIC) {
+		return 0;
+	}
+	if (h.flags & FLAG_LASTFILE) {
+		return 1;
+	}
+	if (h.nameLen < 0 || h.attrLen < 0 || h.fileLenComp < 0 ||
+			!espFsFits(img, p + sizeof(EspFsHeader),
+				(size_t)h.nameLen + (size_t)h.attrLen + (size_t)h.fileLenComp)) {
+		return 0;
+	}
+
+	attr = p + sizeof(EspFsHeader) + h.nameLen;
+	end = attr + h.attrLen;
+	while (attr < end) {
+		if ((size_t)(end - attr) < sizeof(EspFsAttr)) {
+			return 0;
+		}
+		readFlashUnaligned((char*)&a, attr, sizeof(EspFsAttr));
+		attr += sizeof(EspFsAttr);
+		if (a.len < 0 || ((a.len + 3) & ~3) > end - attr) {
+			return 0;
+		}
+		attr += (a.len + 3) & ~3;
+	}
+	return 1;
+}
+
+
+//Whether the entries the offsets in attribute type of the entry at p point at are sane
+static int ICACHE_FLASH_ATTR espFsRefsOk(EspFsImage *img, char *p, int type) {
+	EspFsFile f;
+	const int32_t *attr;
+	int32_t offset;
+	int len = 4;
+
+	if (img->len == 0) {
+		return 1;
+	}
+	f.header = (EspFsHeader *)p;
+	attr = espFsAttr(&f, type, &len);
+	for (int i = 0; attr != NULL && i + 4 <= len; i += 4) {
+		readFlashUnaligned((char*)&offset, (char*)attr + i, 4);
+		if (!espFsFits(img, p + offset, 0) || !espFsEntryOk(img, p + offset)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static EspFsInitResult scanEspFS(EspFsImage *img) {
+	char *p = img->data;
+	char *next;
+	char *target;
 	char namebuf[256];
 
 	EspFsHeader h;
@@ -131,12 +532,19 @@ static void scanEspFS(void) {
 
 	while(1) {
 		// Grab the next file header.
-		readFlashAligned((uint32_t *)&h, (uint32_t)p, sizeof(EspFsHeader));
+		if (!espFsEntryOk(img, p)) {
+			httpd_printf("Entry past the end or corrupt. EspFS image broken.\n");
+            freeEspFS(img->index);
+            img->index = NULL;
+			return ESPFS_INIT_RESULT_NO_IMAGE;
+		}
+		readFlashAligned((uint32_t *)&h, (uintptr_t)p, sizeof(EspFsHeader));
 
 		if (h.magic != ESPFS_MAGIC) {
 			httpd_printf("Magic mismatch. EspFS image broken.\n");
-            freeEspFS();
-			return;
+            freeEspFS(img->index);
+            img->index = NULL;
+			return ESPFS_INIT_RESULT_NO_IMAGE;
 		}
 
 		if (h.flags & FLAG_LASTFILE) {
@@ -144,70 +552,288 @@ static void scanEspFS(void) {
 			break;
 		}
 
+		next = p + sizeof(EspFsHeader) + h.nameLen + h.attrLen + h.fileLenComp;
+		if ((uintptr_t)next & 3) {
+            next += 4 - ((uintptr_t)next & 3); // align to next 32bit val
+        }
+
+		if (!espFsRefsOk(img, p, ATTR_ALIAS) || !espFsRefsOk(img, p, ATTR_VARIANTS) ||
+				!espFsRefsOk(img, p, ATTR_DICTIONARY)) {
+			httpd_printf("Entry pointing out of the image. EspFS image broken.\n");
+            freeEspFS(img->index);
+            img->index = NULL;
+			return ESPFS_INIT_RESULT_NO_IMAGE;
+		}
+
+		// Alternative encodings are only reachable through their primary entry, the dictionary
+		// only through the files using it.
+		if (h.flags & (FLAG_VARIANT | FLAG_DICTIONARY)) {
+			p = next;
+			continue;
+		}
+
+		// Aliases are resolved here, so opening one costs nothing extra.
+		target = p;
+		if (h.flags & FLAG_ALIAS) {
+			EspFsFile a;
+			const int32_t *attr;
+			int32_t offset;
+			a.header = (EspFsHeader *)p;
+			attr = espFsAttr(&a, ATTR_ALIAS, NULL);
+			if (attr == NULL) {
+				p = next;
+				continue;
+			}
+			readFlashUnaligned((char*)&offset, (char*)attr, 4);
+			target = p + offset;
+			if (h.flags & FLAG_FALLBACK) {
+				img->fallback = target;
+				p = next;
+				continue;
+			}
+		}
+
         f = calloc(1, sizeof(*f));
 
         if (f == NULL) {
 			httpd_printf("Failed to scan, out of memory.\n");
-            freeEspFS();
-			return;
+            freeEspFS(img->index);
+            img->index = NULL;
+			return ESPFS_INIT_RESULT_NO_MEM;
         }
 
-        f->position = p;
+        f->position = target;
 
-		// Grab the name of the file.
+		// Grab the name of the file, without reading past it: the image may end right after.
 		p += sizeof(EspFsHeader);
-		readFlashAligned((uint32_t *)&namebuf, (uint32_t)p, sizeof(namebuf));
+		readFlashAligned((uint32_t *)&namebuf, (uintptr_t)p,
+				(h.nameLen < sizeof(namebuf)) ? h.nameLen : sizeof(namebuf));
+		namebuf[sizeof(namebuf) - 1] = '\0';
 
         size_t name_len = strlen(namebuf) + 1;
         f->name = calloc(name_len, sizeof(*(f->name)));
         if (f->name == NULL) {
 			httpd_printf("Failed to scan, out of memory.\n");
             free(f);
-            freeEspFS();
-			return;
+            freeEspFS(img->index);
+            img->index = NULL;
+			return ESPFS_INIT_RESULT_NO_MEM;
         }
 
         snprintf(f->name, name_len, "%s", namebuf);
 
-		p += h.nameLen + h.fileLenComp;
-		if ((int)p & 3) {
-            p += 4 - ((int)p &3 ); // align to next 32bit val
-        }
+		p = next;
 
-        if (_fs != NULL) {
-            f->next = _fs;
-        }
+        f->next = img->index;
+        img->index = f;
+	}
+
+	return ESPFS_INIT_RESULT_OK;
+}
 
-        _fs = f;
+
+static void ICACHE_FLASH_ATTR espFsImageFree(EspFsImage *img) {
+	freeEspFS(img->index);
+	if (img->release != NULL) {
+		img->release(img->arg);
 	}
+	free(img);
 }
 
 
-EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
-#ifndef ESP32
+//Drop a reference to an image, freeing it if it was the last one to an unmounted image.
+static void ICACHE_FLASH_ATTR espFsImagePut(EspFsImage *img) {
+	int last;
+
+	ESPFS_LOCK();
+	last = (--img->users == 0 && !img->mounted);
+	ESPFS_UNLOCK();
+
+	if (last) {
+		espFsImageFree(img);
+	}
+}
+
+
+//Put img (or nothing) in layer, releasing the image that was there once its files are closed.
+static void ICACHE_FLASH_ATTR espFsSwap(int layer, EspFsImage *img) {
+	EspFsImage *old;
+	int last = 0;
+
+	ESPFS_LOCK();
+	old = espFsImages[layer];
+	espFsImages[layer] = img;
+	if (old != NULL) {
+		old->mounted = 0;
+		last = (old->users == 0);
+	}
+	ESPFS_UNLOCK();
+
+	if (last) {
+		espFsImageFree(old);
+	}
+}
+
+
+//Mount the image of len bytes (0 if unknown) at flashAddress in layer, replacing whatever was
+//mounted there. Files opened before keep reading the old image; release(arg), if given, is
+//called when nothing uses the image anymore after it has been replaced or unmounted.
+EspFsInitResult ICACHE_FLASH_ATTR espFsMount(int layer, void *flashAddress, size_t len,
+		void (*release)(void *arg), void *arg) {
+	EspFsInitResult res;
+	EspFsImage *img;
+
+	if (layer < 0 || layer >= ESPFS_MAX_IMAGES) {
+		return ESPFS_INIT_RESULT_BAD_LAYER;
+	}
+
+#if defined(__ets__) && !defined(ESP32)
 	if((uint32_t)flashAddress > 0x40000000) {
 		flashAddress = (void*)((uint32_t)flashAddress-FLASH_BASE_ADDR);
 	}
+#endif
 
 	// base address must be aligned to 4 bytes
-	if (((int)flashAddress & 3) != 0) {
+	if (((uintptr_t)flashAddress & 3) != 0) {
 		return ESPFS_INIT_RESULT_BAD_ALIGN;
 	}
-#endif
+
+	if (len != 0 && len < sizeof(EspFsHeader)) {
+		return ESPFS_INIT_RESULT_NO_IMAGE;
+	}
 
 	// check if there is valid header at address
 	EspFsHeader testHeader;
 	readFlashUnaligned((char*)&testHeader, (char*)flashAddress, sizeof(EspFsHeader));
 	printf("Esp magic: %x (should be %x)\n", testHeader.magic, ESPFS_MAGIC);
+	if (testHeader.magic == ESPFS_MAGIC_OLD) {
+		httpd_printf("EspFS image of an older format, rebuild it with this mkespfsimage.\n");
+	}
 	if (testHeader.magic != ESPFS_MAGIC) {
 		return ESPFS_INIT_RESULT_NO_IMAGE;
 	}
 
-	espFsData = (char *)flashAddress;
-    scanEspFS();
+	img = calloc(1, sizeof(EspFsImage));
+	if (img == NULL) {
+		return ESPFS_INIT_RESULT_NO_MEM;
+	}
+
+	img->data = (char *)flashAddress;
+	img->len = len;
+	res = scanEspFS(img);
+	if (res != ESPFS_INIT_RESULT_OK) {
+		free(img);
+		return res;
+	}
+
+	img->mounted = 1;
+	img->release = release;
+	img->arg = arg;
+	ESPFS_LOCK();
+	img->generation = ++espFsGeneration;
+	ESPFS_UNLOCK();
+
+	espFsSwap(layer, img);
 	return ESPFS_INIT_RESULT_OK;
 }
 
+
+//Unmount the image in layer. Files opened from it can still be read until they are closed.
+void ICACHE_FLASH_ATTR espFsUnmount(int layer) {
+	if (layer >= 0 && layer < ESPFS_MAX_IMAGES) {
+		espFsSwap(layer, NULL);
+	}
+}
+
+
+EspFsInitResult ICACHE_FLASH_ATTR espFsInit(void *flashAddress) {
+	return espFsMount(0, flashAddress, 0, NULL, NULL);
+}
+
+
+#if defined(ESP_PLATFORM) && !defined(CONFIG_IDF_TARGET_LINUX)
+static void ICACHE_FLASH_ATTR espFsPartitionRelease(void *arg) {
+	spi_flash_munmap((spi_flash_mmap_handle_t)(uintptr_t)arg);
+}
+
+//Map the data partition called label and mount the image in it. To update the files at runtime,
+//write the new image to a second partition and mount that one in the same layer.
+EspFsInitResult ICACHE_FLASH_ATTR espFsMountPartition(int layer, const char *label) {
+	const esp_partition_t *part;
+	const void *ptr;
+	spi_flash_mmap_handle_t handle;
+	EspFsInitResult res;
+
+	part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+	if (part == NULL) {
+		return ESPFS_INIT_RESULT_NO_IMAGE;
+	}
+
+	if (esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &ptr, &handle) != ESP_OK) {
+		return ESPFS_INIT_RESULT_NO_MEM;
+	}
+
+	res = espFsMount(layer, (void *)ptr, part->size, espFsPartitionRelease,
+			(void *)(uintptr_t)handle);
+	if (res != ESPFS_INIT_RESULT_OK) {
+		spi_flash_munmap(handle);
+	}
+	return res;
+}
+#endif
+
+
+#if !(__ets__ || ESP_PLATFORM) || defined(CONFIG_IDF_TARGET_LINUX)
+typedef struct {
+	void *addr;
+	size_t len;
+} EspFsMapping;
+
+static void ICACHE_FLASH_ATTR espFsFileRelease(void *arg) {
+	EspFsMapping *m = (EspFsMapping *)arg;
+	munmap(m->addr, m->len);
+	free(m);
+}
+
+//Map the image file at path and mount it, for host builds.
+EspFsInitResult ICACHE_FLASH_ATTR espFsMountFile(int layer, const char *path) {
+	struct stat st;
+	EspFsMapping *m;
+	EspFsInitResult res;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return ESPFS_INIT_RESULT_NO_IMAGE;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(EspFsHeader)) {
+		close(fd);
+		return ESPFS_INIT_RESULT_NO_IMAGE;
+	}
+
+	m = malloc(sizeof(EspFsMapping));
+	if (m == NULL) {
+		close(fd);
+		return ESPFS_INIT_RESULT_NO_MEM;
+	}
+
+	m->len = st.st_size;
+	m->addr = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m->addr == MAP_FAILED) {
+		free(m);
+		return ESPFS_INIT_RESULT_NO_MEM;
+	}
+
+	res = espFsMount(layer, m->addr, m->len, espFsFileRelease, m);
+	if (res != ESPFS_INIT_RESULT_OK) {
+		espFsFileRelease(m);
+	}
+	return res;
+}
+#endif
+
 //Copies len bytes over from dst to src, but does it using *only*
 //aligned 32-bit reads. Yes, it's no too optimized but it's short and sweet and it works.
 
@@ -223,82 +849,561 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 	return (int)flags;
 }
 
-//Open a file and return a pointer to the file desc struct.
-EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
-	if (espFsData == NULL) {
-		httpd_printf("Call espFsInit first!\n");
+// Returns a pointer to the value of attribute type of the opened file, or NULL if the file
+// has no such attribute. The value lives in the image itself; if len is not NULL the value
+// length is stored there.
+const void ICACHE_FLASH_ATTR *espFsAttr(EspFsFile *fh, int type, int *len) {
+	if (fh == NULL) {
 		return NULL;
 	}
 
-	EspFsFile *r;
-    struct EspFs *f = _fs;
+	char *p = (char *)fh->header + sizeof(EspFsHeader) + fh->header->nameLen;
+	char *end = p + fh->header->attrLen;
+	EspFsAttr a;
 
-	// Strip initial slashes
-	while(fileName[0]=='/') fileName++;
+	while (p < end) {
+		readFlashUnaligned((char*)&a, p, sizeof(EspFsAttr));
+		p += sizeof(EspFsAttr);
+		if (a.type == type) {
+			if (len != NULL) *len = a.len;
+			return p;
+		}
+		p += (a.len + 3) & ~3;
+	}
 
-    while (f != NULL) {
-		if (strcmp(f->name, fileName) == 0) {
-            break;
-        }
+	return NULL;
+}
 
-        f = f->next;
-    }
+#ifdef ESPFS_HEATSHRINK
+//Put the end of the dictionary a file was compressed against in the decoder window, where
+//mkespfsimage put it in the encoder's.
+static void ICACHE_FLASH_ATTR espFsPrime(EspFsFile *fh) {
+	heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
+	int32_t window=1<<HEATSHRINK_DECODER_WINDOW_BITS(dec);
+	int32_t len=fh->dictLen;
+
+	if (fh->dict==NULL) {
+		return;
+	}
 
-    if (f == NULL) {
-		httpd_printf("File not found: %s\n", fileName);
-        return NULL;
-    }
+	if (len>window) len=window;
+	readFlashUnaligned((char *)dec->buffers+HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(dec)+window-len,
+			fh->dict+fh->dictLen-len, len);
+}
 
-    r = malloc(sizeof(EspFsFile));  // Alloc file desc mem
+//Position a heatshrink file at the start of restart block n. Files without a block table
+//are a single block.
+static void ICACHE_FLASH_ATTR espFsStartBlock(EspFsFile *fh, int n) {
+	int32_t flen=fh->fileLenComp, fdlen=fh->fileLenDecomp, nblocks, offset, next;
 
-    if (r == NULL) {
-		httpd_printf("Failed to alloc file handler for file: %s\n", fileName);
-        return NULL;
-    }
+	if (fh->blocks == NULL) {
+		fh->posComp = fh->posStart + 1; // skip decoder params
+		fh->posDecomp = 0;
+		fh->blockEnd = fdlen;
+		fh->blockEndComp = fh->posStart + flen;
+	} else {
+		nblocks = (fdlen + fh->blockSize - 1) / fh->blockSize;
+		readFlashUnaligned((char*)&offset, (char*)&fh->blocks[n], 4);
+		if (n + 1 < nblocks) {
+			readFlashUnaligned((char*)&next, (char*)&fh->blocks[n + 1], 4);
+			fh->blockEnd = (n + 1) * fh->blockSize;
+		} else {
+			next = flen;
+			fh->blockEnd = fdlen;
+		}
+		fh->posComp = fh->posStart + offset;
+		fh->posDecomp = n * fh->blockSize;
+		fh->blockEndComp = fh->posStart + next;
+	}
+
+	if (fh->decompData != NULL) {
+		heatshrink_decoder_reset((heatshrink_decoder *)fh->decompData);
+		espFsPrime(fh);
+	}
+}
+#endif
 
-    r->header = (EspFsHeader *)f->position;
+//Point a file handle at the start of the file entry at position.
+static int ICACHE_FLASH_ATTR espFsInitFile(EspFsFile *r, char *position) {
+    r->header = (EspFsHeader *)position;
 	r->decompressor = r->header->compression;
-	r->posComp = f->position + r->header->nameLen + sizeof(EspFsHeader);
+	r->posComp = position + sizeof(EspFsHeader) + r->header->nameLen + r->header->attrLen;
 	r->posStart = r->posComp;
 	r->posDecomp = 0;
+	readFlashUnaligned((char*)&r->fileLenComp, (char*)&r->header->fileLenComp, 4);
+	readFlashUnaligned((char*)&r->fileLenDecomp, (char*)&r->header->fileLenDecomp, 4);
+	r->decompData = NULL;
+	r->blocks = NULL;
+	r->blockSize = 0;
+#if ESPFS_CACHE_SIZE > 0
+	r->cache = NULL;
+#endif
+#ifdef ESPFS_HEATSHRINK
+	r->dict = NULL;
+	r->dictLen = 0;
+#endif
 
     if (r->header->compression == COMPRESS_NONE) {
-	    r->decompData=NULL;
+	    // Nothing to set up.
 #ifdef ESPFS_HEATSHRINK
     } else if (r->header->compression==COMPRESS_HEATSHRINK) {
-        // File is compressed with Heatshrink.
-	    char parm;
-	    heatshrink_decoder *dec;
-	    // Decoder params are stored in 1st byte.
-	    readFlashUnaligned(&parm, r->posComp, 1);
-		r->posComp++;
-		httpd_printf("Heatshrink compressed file; decode parms = %x\n", parm);
-		dec = heatshrink_decoder_alloc(16, (parm >> 4) & 0xf, parm & 0xf);
-		r->decompData = dec;
+        // File is compressed with Heatshrink. Decoder params are stored in 1st byte;
+        // the decoder itself is only allocated on the first read, so opening a file
+        // just to look at its header or attributes stays cheap.
+        // Large files may be split in independently compressed blocks so
+        // espFsSeek can restart the decoder near any offset.
+		const int32_t *blocks = espFsAttr(r, ATTR_BLOCKS, NULL);
+		const int32_t *dict = espFsAttr(r, ATTR_DICTIONARY, NULL);
+		if (blocks != NULL) {
+			readFlashUnaligned((char*)&r->blockSize, (char*)blocks, 4);
+			r->blocks = blocks + 1;
+		}
+		// Small files are compressed against a dictionary that is stored once in the image.
+		if (dict != NULL) {
+			EspFsHeader *d;
+			int32_t offset;
+			readFlashUnaligned((char*)&offset, (char*)dict, 4);
+			d = (EspFsHeader *)(position + offset);
+			r->dict = (char *)d + sizeof(EspFsHeader) + d->nameLen + d->attrLen;
+			readFlashUnaligned((char*)&r->dictLen, (char*)&d->fileLenComp, 4);
+		}
+		espFsStartBlock(r, 0);
+#endif
+#ifdef ESPFS_LZ4
+	} else if (r->header->compression==COMPRESS_LZ4) {
+		// LZ4 files always consist of independent blocks. One is decoded at a time, into a
+		// buffer that is allocated on the first read.
+		const int32_t *blocks = espFsAttr(r, ATTR_BLOCKS, NULL);
+		if (blocks == NULL) {
+			httpd_printf("LZ4 compressed file without blocks\n");
+			return -1;
+		}
+		readFlashUnaligned((char*)&r->blockSize, (char*)blocks, 4);
+		if (r->blockSize <= 0 || r->blockSize > ESPFS_LZ4_MAX_BLOCK_SIZE) {
+			httpd_printf("Unsupported LZ4 block size: %d\n", r->blockSize);
+			return -1;
+		}
+		r->blocks = blocks + 1;
+		r->blockEnd = 0;
 #endif
 	} else {
 	    httpd_printf("Invalid compression: %d\n", r->header->compression);
-	    return NULL;
+	    return -1;
+	}
+
+	return 0;
+}
+
+#ifdef ESPFS_GUNZIP
+//Returns the deflate window bits a FLAG_GZIP file was compressed with.
+static int ICACHE_FLASH_ATTR espFsGzipWindow(EspFsFile *fh) {
+	const int8_t *bits = espFsAttr(fh, ATTR_GZIP_WINDOW, NULL);
+	int8_t window = GUNZIP_MAX_WINDOW_BITS;
+	if (bits != NULL) {
+		readFlashUnaligned((char*)&window, (char*)bits, 1);
+	}
+	return window;
+}
+#endif
+
+#if ESPFS_TRACE_SIZE > 0
+//The last ESPFS_TRACE_SIZE files opened, for mkespfsimage -t to lay out the next image by. An
+//entry is identified by its offset in the image it was opened from.
+typedef struct {
+	uint32_t time; //ms
+	uint32_t generation; //of the image
+	int32_t offset;
+} EspFsTraceEntry;
+
+static EspFsTraceEntry espFsTrace[ESPFS_TRACE_SIZE];
+static uint32_t espFsTraceCount = 0; //entries ever recorded
+
+static uint32_t ICACHE_FLASH_ATTR espFsTraceTime(void) {
+#if defined(ESP_PLATFORM) && !defined(CONFIG_IDF_TARGET_LINUX)
+	return (uint32_t)(esp_timer_get_time() / 1000);
+#elif defined(__ets__)
+	return system_get_time() / 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+static void ICACHE_FLASH_ATTR espFsTraceAdd(EspFsImage *img, char *position) {
+	EspFsTraceEntry *e = &espFsTrace[espFsTraceCount % ESPFS_TRACE_SIZE];
+	e->time = espFsTraceTime();
+	e->generation = img->generation;
+	e->offset = position - img->data;
+	espFsTraceCount++;
+}
+#endif
+
+//Writes the trace as "<ms> <name>" lines to buff, starting at entry *pos (0 for the oldest one
+//still recorded), as far as whole lines fit. A line too long for buff on its own is cut short.
+//Entries of images no longer mounted are skipped.
+//Returns the number of bytes written, 0 once the end of the trace is reached.
+int ICACHE_FLASH_ATTR espFsTraceRead(uint32_t *pos, char *buff, int len) {
+#if ESPFS_TRACE_SIZE > 0
+	EspFsTraceEntry e;
+	EspFsImage *img;
+	int written = 0;
+	int layer, n;
+
+	if (espFsTraceCount > ESPFS_TRACE_SIZE && *pos < espFsTraceCount - ESPFS_TRACE_SIZE) {
+		*pos = espFsTraceCount - ESPFS_TRACE_SIZE;
+	}
+
+	for (; *pos < espFsTraceCount; (*pos)++) {
+		e = espFsTrace[*pos % ESPFS_TRACE_SIZE];
+
+		ESPFS_LOCK();
+		for (layer = 0; layer < ESPFS_MAX_IMAGES; layer++) {
+			img = espFsImages[layer];
+			if (img != NULL && img->generation == e.generation) {
+				img->users++;
+				break;
+			}
+		}
+		ESPFS_UNLOCK();
+
+		if (layer == ESPFS_MAX_IMAGES) {
+			continue;
+		}
+
+		n = snprintf(buff + written, len - written, "%u %s\n", (unsigned)e.time,
+				img->data + e.offset + sizeof(EspFsHeader));
+		espFsImagePut(img);
+		if (n >= len - written) {
+			if (written > 0 || len < 2) {
+				break;
+			}
+			//Line longer than the whole buffer: keep what fits, drop the rest up to its newline
+			n = len - 1;
+			buff[n - 1] = '\n';
+		}
+		written += n;
 	}
 
+	return written;
+#else
+	return 0;
+#endif
+}
+
+//Open the entry at position of img, taking over the reference to img the caller holds.
+static EspFsFile ICACHE_FLASH_ATTR *espFsOpenAt(EspFsImage *img, char *position) {
+	EspFsFile *r = espFsFileGet();  // Alloc file desc mem
+
+    if (r == NULL) {
+		httpd_printf("Failed to alloc file handler\n");
+		espFsImagePut(img);
+        return NULL;
+    }
+
+    if (espFsInitFile(r, position) != 0) {
+	    espFsFilePut(r);
+	    espFsImagePut(img);
+	    return NULL;
+    }
+
+    r->image = img;
+#if ESPFS_TRACE_SIZE > 0
+    espFsTraceAdd(img, position);
+#endif
     return r;
 }
 
+//Open a file and return a pointer to the file desc struct.
+EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
+	EspFsImage *img = NULL;
+    struct EspFs *f = NULL;
+	int layer;
+
+	// Strip initial slashes
+	while(fileName[0]=='/') fileName++;
+
+	// Look the file up from the top layer down
+	for (layer = ESPFS_MAX_IMAGES - 1; layer >= 0 && f == NULL; layer--) {
+		ESPFS_LOCK();
+		img = espFsImages[layer];
+		if (img != NULL) {
+			img->users++;
+		}
+		ESPFS_UNLOCK();
+
+		if (img == NULL) {
+			continue;
+		}
+
+		for (f = img->index; f != NULL; f = f->next) {
+			if (strcmp(f->name, fileName) == 0) {
+				break;
+			}
+		}
+
+		if (f == NULL) {
+			espFsImagePut(img);
+		}
+	}
+
+    if (f == NULL) {
+		httpd_printf("File not found: %s\n", fileName);
+        return NULL;
+    }
+
+    return espFsOpenAt(img, f->position);
+}
+
+//Open the file unknown paths resolve to, as recorded in the topmost image that has one.
+EspFsFile ICACHE_FLASH_ATTR *espFsOpenFallback(void) {
+	EspFsImage *img = NULL;
+	int layer;
+
+	for (layer = ESPFS_MAX_IMAGES - 1; layer >= 0; layer--) {
+		ESPFS_LOCK();
+		img = espFsImages[layer];
+		if (img != NULL && img->fallback != NULL) {
+			img->users++;
+		} else {
+			img = NULL;
+		}
+		ESPFS_UNLOCK();
+
+		if (img != NULL) {
+			return espFsOpenAt(img, img->fallback);
+		}
+	}
+
+	return NULL;
+}
+
+//Returns the name of an opened file, which differs from the one it was opened with if that
+//was an alias.
+const char ICACHE_FLASH_ATTR *espFsName(EspFsFile *fh) {
+	if (fh == NULL) {
+		return NULL;
+	}
+	return (const char *)fh->header + sizeof(EspFsHeader);
+}
+
+//Returns the flags and the size espFsRead would yield of alternative encoding n of an opened
+//file, where n=0 is the file itself. Returns 0 if the variant exists, -1 if it doesn't.
+int ICACHE_FLASH_ATTR espFsVariant(EspFsFile *fh, int n, int *flags, int *size) {
+	int len;
+	int32_t offset;
+	const int32_t *variants;
+	EspFsFile v;
+
+	if (fh == NULL || n < 0) {
+		return -1;
+	}
+
+	if (n == 0) {
+		*flags = espFsFlags(fh);
+		*size = espFsSize(fh);
+		return 0;
+	}
+
+	variants = espFsAttr(fh, ATTR_VARIANTS, &len);
+	if (variants == NULL || n > len / (int)sizeof(int32_t)) {
+		return -1;
+	}
+
+	readFlashUnaligned((char*)&offset, (char*)&variants[n - 1], 4);
+	v.header = (EspFsHeader *)((char *)fh->header + offset);
+	v.decompressor = v.header->compression;
+	readFlashUnaligned((char*)&v.fileLenComp, (char*)&v.header->fileLenComp, 4);
+	readFlashUnaligned((char*)&v.fileLenDecomp, (char*)&v.header->fileLenDecomp, 4);
+	*flags = espFsFlags(&v);
+	*size = espFsSize(&v);
+	return 0;
+}
+
+//Make the opened file read alternative encoding n (see espFsVariant) instead. Must be called
+//before the first read. Returns 0 on success.
+int ICACHE_FLASH_ATTR espFsSelectVariant(EspFsFile *fh, int n) {
+	int len;
+	int32_t offset;
+	const int32_t *variants;
+
+	if (fh == NULL || n < 0 || fh->decompData != NULL) {
+		return -1;
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	variants = espFsAttr(fh, ATTR_VARIANTS, &len);
+	if (variants == NULL || n > len / (int)sizeof(int32_t)) {
+		return -1;
+	}
+
+	readFlashUnaligned((char*)&offset, (char*)&variants[n - 1], 4);
+	return espFsInitFile(fh, (char *)fh->header + offset);
+}
+
 
-//Read len bytes from the given file into buff. Returns the actual amount of bytes read.
-int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
-	int flen;
 #ifdef ESPFS_HEATSHRINK
-	int fdlen;
+//Decode the next len bytes of a heatshrink file into buff.
+static int ICACHE_FLASH_ATTR espFsReadHeatshrink(EspFsFile *fh, char *buff, int len) {
+	int fdlen=fh->fileLenDecomp;
+	int decoded=0;
+	size_t elen, olen, rlen;
+#if defined(__ets__) && !defined(ESP32)
+	char ebuff[16];
 #endif
+	heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
+	if (fh->posDecomp == fdlen) {
+		return 0;
+	}
+
+	if (dec==NULL) {
+		char parm;
+		readFlashUnaligned(&parm, fh->posStart, 1);
+		httpd_printf("Heatshrink compressed file; decode parms = %x\n", parm);
+		dec=espFsDecoderGet(fh, (parm >> 4) & 0xf, parm & 0xf);
+		if (dec==NULL) {
+			httpd_printf("Failed to alloc heatshrink decoder\n");
+			return 0;
+		}
+		fh->decompData=dec;
+		espFsPrime(fh);
+	}
+
+	while(decoded<len) {
+		if (fh->posDecomp==fh->blockEnd) {
+			if (fh->posDecomp==fdlen) break;
+			//Blocks are compressed independently; restart the decoder for the next one.
+			espFsStartBlock(fh, fh->posDecomp/fh->blockSize);
+		}
+
+		//Feed data into the decompressor
+		//ToDo: Check ret val of heatshrink fns for errors
+		elen=fh->blockEndComp-fh->posComp;
+		if (elen>0) {
+#if defined(__ets__) && !defined(ESP32)
+			readFlashUnaligned(ebuff, fh->posComp, 16);
+			heatshrink_decoder_sink(dec, (uint8_t *)ebuff, (elen>16)?16:elen, &rlen);
+#else
+			//The image is mapped; sink as much as the decoder takes straight from it.
+			heatshrink_decoder_sink(dec, (uint8_t *)fh->posComp, elen, &rlen);
+#endif
+			fh->posComp+=rlen;
+		}
+		//Decode straight into buff, never past the end of the block
+		olen=len-decoded;
+		if (olen>fh->blockEnd-fh->posDecomp) olen=fh->blockEnd-fh->posDecomp;
+		heatshrink_decoder_poll(dec, (uint8_t *)buff, olen, &rlen);
+		fh->posDecomp+=rlen;
+		buff+=rlen;
+		decoded+=rlen;
+
+		if (elen==0 && rlen==0) {
+			httpd_printf("Heatshrink stream ended early at %d\n", fh->posDecomp);
+			break;
+		}
+	}
+	return decoded;
+}
+#endif
+
+#ifdef ESPFS_LZ4
+//Copy the next len bytes of an LZ4 file into buff, decoding the blocks they are in.
+static int ICACHE_FLASH_ATTR espFsReadLz4(EspFsFile *fh, char *buff, int len) {
+	int32_t fdlen=fh->fileLenDecomp, nblocks, n, start, end, offset, next;
+	int decoded=0, chunk;
+
+	nblocks=(fdlen+fh->blockSize-1)/fh->blockSize;
+	while (decoded<len && fh->posDecomp<fdlen) {
+		n=fh->posDecomp/fh->blockSize;
+		start=n*fh->blockSize;
+		end=(n+1<nblocks)?start+fh->blockSize:fdlen;
+
+		if (fh->blockEnd!=end) {
+			readFlashUnaligned((char*)&offset, (char*)&fh->blocks[n], 4);
+			if (n+1<nblocks) {
+				readFlashUnaligned((char*)&next, (char*)&fh->blocks[n+1], 4);
+			} else {
+				next=fh->fileLenComp;
+			}
+
+			//A whole block that is wanted anyway is decoded straight into buff.
+			if (fh->posDecomp==start && len-decoded>=end-start) {
+				if (lz4_decode_block((uint8_t *)fh->posStart+offset, next-offset,
+						(uint8_t *)buff, end-start)!=end-start) {
+					httpd_printf("Corrupt LZ4 block %d\n", n);
+					break;
+				}
+				fh->posDecomp=end;
+				buff+=end-start;
+				decoded+=end-start;
+				continue;
+			}
+
+			if (fh->decompData==NULL) {
+				fh->decompData=malloc(fh->blockSize);
+				if (fh->decompData==NULL) {
+					httpd_printf("Failed to alloc LZ4 block buffer\n");
+					break;
+				}
+			}
+
+			fh->blockEnd=0;
+			if (lz4_decode_block((uint8_t *)fh->posStart+offset, next-offset,
+					(uint8_t *)fh->decompData, end-start)!=end-start) {
+				httpd_printf("Corrupt LZ4 block %d\n", n);
+				break;
+			}
+			fh->blockEnd=end;
+		}
+
+		chunk=end-fh->posDecomp;
+		if (chunk>len-decoded) chunk=len-decoded;
+		memcpy(buff, (char *)fh->decompData+(fh->posDecomp-start), chunk);
+		fh->posDecomp+=chunk;
+		buff+=chunk;
+		decoded+=chunk;
+	}
+	return decoded;
+}
+#endif
+
+#if ESPFS_CACHE_SIZE > 0
+//Read from the decoded copy of a file, decoding more of it first if fh is ahead of the others.
+static int ICACHE_FLASH_ATTR espFsCacheRead(EspFsFile *fh, char *buff, int len) {
+	EspFsCacheEntry *e=fh->cache;
+	int n;
+
+	while (e->filled<fh->posDecomp+len && e->filled<e->len) {
+		n=espFsReadHeatshrink(&e->src, e->data+e->filled, fh->posDecomp+len-e->filled);
+		if (n<=0) {
+			return 0;
+		}
+		e->filled+=n;
+		if (e->filled==e->len) {
+			//Complete; the decoder isn't needed anymore.
+			heatshrink_decoder_free((heatshrink_decoder *)e->src.decompData);
+			e->src.decompData=NULL;
+		}
+	}
+
+	if (len>e->filled-fh->posDecomp) len=e->filled-fh->posDecomp;
+	memcpy(buff, e->data+fh->posDecomp, len);
+	fh->posDecomp+=len;
+	return len;
+}
+#endif
+
+//Read len bytes from the given file into buff. Returns the actual amount of bytes read.
+int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 	if (fh==NULL) return 0;
-		
-	readFlashUnaligned((char*)&flen, (char*)&fh->header->fileLenComp, 4);
-	//Cache file length.
+
 	//Do stuff depending on the way the file is compressed.
 	if (fh->decompressor==COMPRESS_NONE) {
 		int toRead;
-		toRead=flen-(fh->posComp-fh->posStart);
+		toRead=fh->fileLenComp-(fh->posComp-fh->posStart);
 		if (len>toRead) len=toRead;
 //		httpd_printf("Reading %d bytes from %x\n", len, (unsigned int)fh->posComp);
 		readFlashUnaligned(buff, fh->posComp, len);
@@ -308,63 +1413,168 @@ int ICACHE_FLASH_ATTR espFsRead(EspFsFile *fh, char *buff, int len) {
 		return len;
 #ifdef ESPFS_HEATSHRINK
 	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
-		readFlashUnaligned((char*)&fdlen, (char*)&fh->header->fileLenDecomp, 4);
-		int decoded=0;
-		size_t elen, rlen;
-		char ebuff[16];
-		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
-//		httpd_printf("Alloc %p\n", dec);
-		if (fh->posDecomp == fdlen) {
+		if (fh->posDecomp == fh->fileLenDecomp) {
 			return 0;
 		}
 
-		// We must ensure that whole file is decompressed and written to output buffer.
-		// This means even when there is no input data (elen==0) try to poll decoder until
-		// posDecomp equals decompressed file length
-
-		while(decoded<len) {
-			//Feed data into the decompressor
-			//ToDo: Check ret val of heatshrink fns for errors
-			elen=flen-(fh->posComp - fh->posStart);
-			if (elen>0) {
-				readFlashUnaligned(ebuff, fh->posComp, 16);
-				heatshrink_decoder_sink(dec, (uint8_t *)ebuff, (elen>16)?16:elen, &rlen);
-				fh->posComp+=rlen;
-			}
-			//Grab decompressed data and put into buff
-			heatshrink_decoder_poll(dec, (uint8_t *)buff, len-decoded, &rlen);
-			fh->posDecomp+=rlen;
-			buff+=rlen;
-			decoded+=rlen;
-
-//			httpd_printf("Elen %d rlen %d d %d pd %ld fdl %d\n",elen,rlen,decoded, fh->posDecomp, fdlen);
-
-			if (elen == 0) {
-				if (fh->posDecomp == fdlen) {
-//					httpd_printf("Decoder finish\n");
-					heatshrink_decoder_finish(dec);
-				}
-				return decoded;
+#if ESPFS_CACHE_SIZE > 0
+		if (fh->cache==NULL && fh->decompData==NULL) {
+			espFsCacheAttach(fh);
+		}
+		if (fh->cache!=NULL) {
+			return espFsCacheRead(fh, buff, len);
+		}
+#endif
+		return espFsReadHeatshrink(fh, buff, len);
+#endif
+#ifdef ESPFS_LZ4
+	} else if (fh->decompressor==COMPRESS_LZ4) {
+		return espFsReadLz4(fh, buff, len);
+#endif
+#ifdef ESPFS_GUNZIP
+	} else if (fh->decompressor==DECOMPRESS_GUNZIP) {
+		gunzip *gz=(gunzip *)fh->decompData;
+		int decoded;
+		if (gz==NULL) {
+			gz=gunzip_alloc(espFsGzipWindow(fh));
+			if (gz==NULL) {
+				httpd_printf("Failed to alloc gunzip decoder\n");
+				return 0;
 			}
+			//ESP32 maps the image into the address space, so the decoder reads it directly.
+			gunzip_reset(gz, (uint8_t *)fh->posStart, fh->fileLenComp);
+			fh->decompData=gz;
 		}
-		return len;
+
+		decoded=gunzip_read(gz, (uint8_t *)buff, len);
+		if (decoded<0) {
+			httpd_printf("Corrupt gzip stream at %d\n", fh->posDecomp);
+			return 0;
+		}
+		fh->posDecomp+=decoded;
+		return decoded;
 #endif
 	}
 	return 0;
 }
 
+//Make reads of a FLAG_GZIP file return the decompressed data instead of the gzip stream.
+//Must be called before the first read. Returns 0 on success, -1 if the file can't be inflated.
+int ICACHE_FLASH_ATTR espFsGunzip(EspFsFile *fh) {
+#ifdef ESPFS_GUNZIP
+	if (fh==NULL || fh->decompressor!=COMPRESS_NONE || (espFsFlags(fh) & FLAG_GZIP)==0) {
+		return -1;
+	}
+
+	int window = espFsGzipWindow(fh);
+	if (window < GUNZIP_MIN_WINDOW_BITS || window > GUNZIP_MAX_WINDOW_BITS) {
+		httpd_printf("Unsupported gzip window: %d\n", window);
+		return -1;
+	}
+
+	//Like heatshrink, the decoder is allocated on the first read.
+	fh->decompressor=DECOMPRESS_GUNZIP;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+//Returns the number of bytes espFsRead yields for the whole file.
+int ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	if (fh==NULL) return -1;
+	if (fh->decompressor==COMPRESS_NONE) {
+		return fh->fileLenComp;
+	}
+	return fh->fileLenDecomp;
+}
+
+//Move the read position to offset, counted in the bytes espFsRead yields. Uncompressed and LZ4
+//files seek directly, heatshrink files restart at the nearest block and decode up to offset.
+//Returns the new position or -1 on error.
+int ICACHE_FLASH_ATTR espFsSeek(EspFsFile *fh, int offset) {
+	char discard[32];
+	int size=espFsSize(fh);
+	int n;
+	if (fh==NULL || offset<0 || offset>size) return -1;
+
+	if (fh->decompressor==COMPRESS_NONE) {
+		fh->posComp=fh->posStart+offset;
+		fh->posDecomp=offset;
+		return offset;
+#ifdef ESPFS_HEATSHRINK
+	} else if (fh->decompressor==COMPRESS_HEATSHRINK) {
+		if (offset==size) {
+			fh->posDecomp=size;
+			fh->blockEnd=size;
+			return offset;
+		}
+
+#if ESPFS_CACHE_SIZE > 0
+		if (fh->cache!=NULL) {
+			fh->posDecomp=offset;
+			return offset;
+		}
+#endif
+
+		if (offset<fh->posDecomp || offset>=fh->blockEnd) {
+			espFsStartBlock(fh, (fh->blocks!=NULL)?offset/fh->blockSize:0);
+		}
+#endif
+#ifdef ESPFS_LZ4
+	} else if (fh->decompressor==COMPRESS_LZ4) {
+		//The block holding offset is decoded by the next read.
+		fh->posDecomp=offset;
+		return offset;
+#endif
+#ifdef ESPFS_GUNZIP
+	} else if (fh->decompressor==DECOMPRESS_GUNZIP) {
+		//Deflate streams can only be restarted from the beginning.
+		if (offset<fh->posDecomp) {
+			if (fh->decompData!=NULL) {
+				gunzip_reset((gunzip *)fh->decompData, (uint8_t *)fh->posStart, fh->fileLenComp);
+			}
+			fh->posDecomp=0;
+		}
+#endif
+	} else {
+		return -1;
+	}
+
+	while (fh->posDecomp<offset) {
+		n=offset-fh->posDecomp;
+		if (n>(int)sizeof(discard)) n=sizeof(discard);
+		if (espFsRead(fh, discard, n)<=0) return -1;
+	}
+	return fh->posDecomp;
+}
+
 //Close the file.
 void ICACHE_FLASH_ATTR espFsClose(EspFsFile *fh) {
 	if (fh==NULL) return;
+#if ESPFS_CACHE_SIZE > 0
+	espFsCacheDetach(fh);
+#endif
 #ifdef ESPFS_HEATSHRINK
-	if (fh->decompressor==COMPRESS_HEATSHRINK) {
+	if (fh->decompressor==COMPRESS_HEATSHRINK && fh->decompData!=NULL) {
 		heatshrink_decoder *dec=(heatshrink_decoder *)fh->decompData;
-		heatshrink_decoder_free(dec);
+		espFsDecoderPut(dec);
 //		httpd_printf("Freed %p\n", dec);
 	}
 #endif
+#ifdef ESPFS_LZ4
+	if (fh->decompressor==COMPRESS_LZ4) {
+		free(fh->decompData);
+	}
+#endif
+#ifdef ESPFS_GUNZIP
+	if (fh->decompressor==DECOMPRESS_GUNZIP && fh->decompData!=NULL) {
+		gunzip_free((gunzip *)fh->decompData);
+	}
+#endif
 //	httpd_printf("Freed %p\n", fh);
-	free(fh);
+	espFsImagePut(fh->image);
+	espFsFilePut(fh);
 }
 
 
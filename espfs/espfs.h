@@ -1,6 +1,8 @@
 #ifndef ESPFS_H
 #define ESPFS_H
 
+#include <stddef.h>
+
 // This define is done in Makefile. If you do not use default Makefile, uncomment
 // to be able to use Heatshrink-compressed espfs images.
 //#define ESPFS_HEATSHRINK
@@ -9,15 +11,34 @@ typedef enum {
 	ESPFS_INIT_RESULT_OK,
 	ESPFS_INIT_RESULT_NO_IMAGE,
 	ESPFS_INIT_RESULT_BAD_ALIGN,
+	ESPFS_INIT_RESULT_NO_MEM,
+	ESPFS_INIT_RESULT_BAD_LAYER,
 } EspFsInitResult;
 
 typedef struct EspFsFile EspFsFile;
 
 EspFsInitResult espFsInit(void *flashAddress);
+EspFsInitResult espFsMount(int layer, void *flashAddress, size_t len, void (*release)(void *arg),
+		void *arg);
+void espFsUnmount(int layer);
+// ESP32: mount the image in a data partition
+EspFsInitResult espFsMountPartition(int layer, const char *label);
+// Host builds: mount an image file
+EspFsInitResult espFsMountFile(int layer, const char *path);
 EspFsFile *espFsOpen(char *fileName);
+EspFsFile *espFsOpenFallback(void);
+const char *espFsName(EspFsFile *fh);
 int espFsFlags(EspFsFile *fh);
+int espFsVariant(EspFsFile *fh, int n, int *flags, int *size);
+int espFsSelectVariant(EspFsFile *fh, int n);
+const void *espFsAttr(EspFsFile *fh, int type, int *len);
+int espFsGunzip(EspFsFile *fh);
 int espFsRead(EspFsFile *fh, char *buff, int len);
+int espFsSize(EspFsFile *fh);
+int espFsSeek(EspFsFile *fh, int offset);
 void espFsClose(EspFsFile *fh);
+// Files opened, when built with ESPFS_TRACE_SIZE
+int espFsTraceRead(uint32_t *pos, char *buff, int len);
 
 
 #endif
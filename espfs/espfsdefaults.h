@@ -0,0 +1,35 @@
+#ifndef ESPFSDEFAULTS_H
+#define ESPFSDEFAULTS_H
+
+/*
+What the fs handler sends for a file the manifest mkespfsimage was given says nothing about. Both
+the handler and mkespfsimage (for the header blocks it prebakes) include this, so a response is
+the same whichever of them made it up.
+*/
+
+#define ESPFS_CACHE_CONTROL "max-age=3600, must-revalidate"
+
+typedef struct {
+	const char *ext;
+	const char *mime;
+} EspFsMimeType;
+
+static const EspFsMimeType espFsMimeTypes[] = {
+	{"html", "text/html"},
+	{"htm", "text/html"},
+	{"css", "text/css"},
+	{"js", "text/javascript"},
+	{"txt", "text/plain"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"png", "image/png"},
+	{"svg", "image/svg+xml"},
+	{"xml", "text/xml"},
+	{"json", "application/json"},
+	{"eot", "application/vnd.ms-fontobject"},
+	{"ttf", "application/font-sfnt"},
+	{"woff", "application/font-woff"},
+	{"woff2", "application/font-woff2"},
+};
+
+#endif
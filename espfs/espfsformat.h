@@ -12,14 +12,65 @@ when trying to do a <4byte or unaligned read.
 The idea 'borrows' from cpio: it's basically a concatenation of {header, filename, file} data.
 Header, filename and file data is 32-bit aligned. The last file is indicated by data-less header
 with the FLAG_LASTFILE flag set.
+
+Between the filename and the file data sits an optional block of attributes (attrLen bytes). Each
+attribute is an EspFsAttr header followed by len bytes of value, padded to a 32-bit boundary.
+
+Heatshrink data starts with a byte holding the window and lookahead sizes. Big files may be
+compressed as a series of independent blocks of a fixed decompressed size, each starting with a
+fresh encoder; ATTR_BLOCKS then lists where each block starts, relative to the start of the data.
+
+Heatshrink normally starts with an all zero window. A file with ATTR_DICTIONARY starts with the
+end of the data of that FLAG_DICTIONARY entry in the window instead (that is, at the smallest
+distances), so even small files find matches from the first byte on. The dictionary is built
+from the small files of the image and stored once; it isn't a file itself.
+
+LZ4 data is always such a series of blocks, each in the LZ4 block format. It compresses worse than
+heatshrink, but decodes byte aligned sequences instead of a bit stream and so a lot faster.
+
+A file can be stored in several encodings. The entry for the name is the primary one; the other
+encodings follow it as entries of the same name with FLAG_VARIANT set, listed in the primary's
+ATTR_VARIANTS. FLAG_GZIP and FLAG_BROTLI mark data that is served with that content-coding.
+
+Entries with FLAG_ALIAS carry no data, only an ATTR_ALIAS pointing at the entry their name resolves
+to, e.g. "dir/" to "dir/index.html", or to a file with the same contents and extension, which is
+only stored once. With FLAG_FALLBACK as well, the target is what unknown paths resolve to (single
+page apps); its name doesn't matter.
+
+ATTR_HEADERS holds the complete header block of a full response with the entry's data, so the
+server can send it as is and only has to end it, optionally after adding headers of its own.
+
+ATTR_CACHE_CONTROL and ATTR_MIME are set from the manifest mkespfsimage was given; every entry of
+the file carries them, variants too. Without them the server uses its default cache policy and
+goes by the extension.
+
+The attributes changed the header, so images with them carry a different magic than the ones
+before ("ESfs"); an image of the old format isn't mounted instead of being misread.
 */
 
 
 #define FLAG_LASTFILE (1<<0)
 #define FLAG_GZIP (1<<1)
+#define FLAG_BROTLI (1<<2)
+#define FLAG_VARIANT (1<<3)
+#define FLAG_ALIAS (1<<4)
+#define FLAG_FALLBACK (1<<5)
+#define FLAG_DICTIONARY (1<<6)
 #define COMPRESS_NONE 0
 #define COMPRESS_HEATSHRINK 1
-#define ESPFS_MAGIC 0x73665345
+#define COMPRESS_LZ4 2
+#define ESPFS_MAGIC 0x61665345 //"ESfa"
+#define ESPFS_MAGIC_OLD 0x73665345 //"ESfs", images without attributes
+
+#define ATTR_ETAG 1 //NUL-terminated, quoted strong entity tag of the stored data
+#define ATTR_BLOCKS 2 //int32 block size, then the int32 data offset of every block
+#define ATTR_GZIP_WINDOW 3 //int8 deflate window bits of a FLAG_GZIP file
+#define ATTR_VARIANTS 4 //int32 offsets of the variant entries, relative to this header
+#define ATTR_ALIAS 5 //int32 offset of the target entry, relative to this header
+#define ATTR_HEADERS 6 //status line and headers of a 200 for the stored data, without the empty line
+#define ATTR_DICTIONARY 7 //int32 offset of the FLAG_DICTIONARY entry, relative to this header
+#define ATTR_CACHE_CONTROL 8 //NUL-terminated Cache-Control value
+#define ATTR_MIME 9 //NUL-terminated Content-Type
 
 typedef struct {
 	int32_t magic;
@@ -28,6 +79,12 @@ typedef struct {
 	int16_t nameLen;
 	int32_t fileLenComp;
 	int32_t fileLenDecomp;
+	int32_t attrLen;
 } __attribute__((packed)) EspFsHeader;
 
+typedef struct {
+	int16_t type;
+	int16_t len;
+} __attribute__((packed)) EspFsAttr;
+
 #endif
\ No newline at end of file
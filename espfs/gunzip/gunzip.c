@@ -0,0 +1,531 @@
+/*
+ Copyright (c) 2018 Jason Kölker
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+/* The huffman table handling follows Mark Adler's puff.c from
+   the zlib distribution, reworked to stop and resume between
+   any two output bytes. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gunzip.h"
+
+
+#define MAXBITS 15
+#define MAXLCODES 286
+#define MAXDCODES 30
+#define FIXLCODES 288
+
+#define FLAG_FHCRC (1 << 1)
+#define FLAG_FEXTRA (1 << 2)
+#define FLAG_FNAME (1 << 3)
+#define FLAG_FCOMMENT (1 << 4)
+
+
+enum gunzip_state {
+    GUNZIP_HEADER,
+    GUNZIP_BLOCK,
+    GUNZIP_STORED,
+    GUNZIP_CODES,
+    GUNZIP_DONE,
+    GUNZIP_ERROR,
+};
+
+
+struct huffman {
+    uint16_t count[MAXBITS + 1];
+    uint16_t *symbol;
+};
+
+
+struct gunzip {
+    const uint8_t *in;
+    size_t in_len;
+    size_t in_pos;
+    uint32_t bitbuf;
+    uint8_t bitcnt;
+    uint8_t underrun;
+
+    enum gunzip_state state;
+    uint8_t last;
+    uint16_t stored_len;
+    uint16_t copy_len;
+    uint16_t copy_dist;
+
+    struct huffman lencode;
+    struct huffman distcode;
+    uint16_t lensym[FIXLCODES];
+    uint16_t distsym[MAXDCODES];
+    uint8_t lengths[MAXLCODES + MAXDCODES];
+
+    uint32_t out_pos;
+    uint16_t window_mask;
+    uint8_t window[];
+};
+
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t code_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+
+gunzip *gunzip_alloc(uint8_t window_bits) {
+    gunzip *gz;
+
+    if (window_bits < GUNZIP_MIN_WINDOW_BITS ||
+            window_bits > GUNZIP_MAX_WINDOW_BITS) {
+        return NULL;
+    }
+
+    gz = malloc(sizeof(*gz) + (1 << window_bits));
+    if (gz == NULL) {
+        return NULL;
+    }
+
+    gz->window_mask = (1 << window_bits) - 1;
+    gz->lencode.symbol = gz->lensym;
+    gz->distcode.symbol = gz->distsym;
+    gunzip_reset(gz, NULL, 0);
+    return gz;
+}
+
+
+void gunzip_free(gunzip *gz) {
+    free(gz);
+}
+
+
+void gunzip_reset(gunzip *gz, const uint8_t *in, size_t in_len) {
+    gz->in = in;
+    gz->in_len = in_len;
+    gz->in_pos = 0;
+    gz->bitbuf = 0;
+    gz->bitcnt = 0;
+    gz->underrun = 0;
+    gz->state = GUNZIP_HEADER;
+    gz->last = 0;
+    gz->stored_len = 0;
+    gz->copy_len = 0;
+    gz->copy_dist = 0;
+    gz->out_pos = 0;
+}
+
+
+static uint32_t bits(gunzip *gz, uint8_t need) {
+    uint32_t val = gz->bitbuf;
+
+    while (gz->bitcnt < need) {
+        if (gz->in_pos == gz->in_len) {
+            gz->underrun = 1;
+            return 0;
+        }
+
+        val |= (uint32_t)gz->in[gz->in_pos++] << gz->bitcnt;
+        gz->bitcnt += 8;
+    }
+
+    gz->bitbuf = val >> need;
+    gz->bitcnt -= need;
+    return val & ((1UL << need) - 1);
+}
+
+
+static int byte(gunzip *gz) {
+    if (gz->in_pos == gz->in_len) {
+        gz->underrun = 1;
+        return 0;
+    }
+
+    return gz->in[gz->in_pos++];
+}
+
+
+static int decode(gunzip *gz, const struct huffman *h) {
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    int len;
+    int count;
+
+    for (len = 1; len <= MAXBITS; len++) {
+        code |= bits(gz, 1);
+        count = h->count[len];
+        if (code - count < first) {
+            return h->symbol[index + (code - first)];
+        }
+
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    return -1;
+}
+
+
+static int construct(struct huffman *h, const uint8_t *length, int n) {
+    uint16_t offs[MAXBITS + 1];
+    int symbol;
+    int len;
+    int left;
+
+    for (len = 0; len <= MAXBITS; len++) {
+        h->count[len] = 0;
+    }
+
+    for (symbol = 0; symbol < n; symbol++) {
+        h->count[length[symbol]]++;
+    }
+
+    if (h->count[0] == n) {
+        return 0;
+    }
+
+    left = 1;
+    for (len = 1; len <= MAXBITS; len++) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) {
+            return left;
+        }
+    }
+
+    offs[1] = 0;
+    for (len = 1; len < MAXBITS; len++) {
+        offs[len + 1] = offs[len] + h->count[len];
+    }
+
+    for (symbol = 0; symbol < n; symbol++) {
+        if (length[symbol] != 0) {
+            h->symbol[offs[length[symbol]]++] = symbol;
+        }
+    }
+
+    return left;
+}
+
+
+static int header(gunzip *gz) {
+    int flags;
+    int len;
+
+    if (byte(gz) != 0x1f || byte(gz) != 0x8b || byte(gz) != 8) {
+        return -1;
+    }
+
+    flags = byte(gz);
+    gz->in_pos += 6;  /* mtime, xfl, os */
+
+    if (flags & FLAG_FEXTRA) {
+        len = byte(gz);
+        len |= byte(gz) << 8;
+        gz->in_pos += len;
+    }
+
+    if (flags & FLAG_FNAME) {
+        while (byte(gz) != 0 && !gz->underrun) {}
+    }
+
+    if (flags & FLAG_FCOMMENT) {
+        while (byte(gz) != 0 && !gz->underrun) {}
+    }
+
+    if (flags & FLAG_FHCRC) {
+        gz->in_pos += 2;
+    }
+
+    if (gz->in_pos > gz->in_len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int fixed(gunzip *gz) {
+    int symbol;
+
+    for (symbol = 0; symbol < 144; symbol++) {
+        gz->lengths[symbol] = 8;
+    }
+    for (; symbol < 256; symbol++) {
+        gz->lengths[symbol] = 9;
+    }
+    for (; symbol < 280; symbol++) {
+        gz->lengths[symbol] = 7;
+    }
+    for (; symbol < FIXLCODES; symbol++) {
+        gz->lengths[symbol] = 8;
+    }
+    construct(&gz->lencode, gz->lengths, FIXLCODES);
+
+    for (symbol = 0; symbol < MAXDCODES; symbol++) {
+        gz->lengths[symbol] = 5;
+    }
+    construct(&gz->distcode, gz->lengths, MAXDCODES);
+
+    return 0;
+}
+
+
+static int dynamic(gunzip *gz) {
+    int nlen = bits(gz, 5) + 257;
+    int ndist = bits(gz, 5) + 1;
+    int ncode = bits(gz, 4) + 4;
+    int index;
+    int err;
+
+    if (nlen > MAXLCODES || ndist > MAXDCODES) {
+        return -1;
+    }
+
+    for (index = 0; index < ncode; index++) {
+        gz->lengths[code_order[index]] = bits(gz, 3);
+    }
+    for (; index < 19; index++) {
+        gz->lengths[code_order[index]] = 0;
+    }
+
+    /* The code length code is decoded with lencode, which is rebuilt below */
+    if (construct(&gz->lencode, gz->lengths, 19) != 0) {
+        return -1;
+    }
+
+    index = 0;
+    while (index < nlen + ndist) {
+        int symbol = decode(gz, &gz->lencode);
+        int len = 0;
+        int repeat;
+
+        if (symbol < 0 || gz->underrun) {
+            return -1;
+        }
+
+        if (symbol < 16) {
+            gz->lengths[index++] = symbol;
+            continue;
+        }
+
+        if (symbol == 16) {
+            if (index == 0) {
+                return -1;
+            }
+            len = gz->lengths[index - 1];
+            repeat = 3 + bits(gz, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + bits(gz, 3);
+        } else {
+            repeat = 11 + bits(gz, 7);
+        }
+
+        if (index + repeat > nlen + ndist) {
+            return -1;
+        }
+
+        while (repeat--) {
+            gz->lengths[index++] = len;
+        }
+    }
+
+    if (gz->lengths[256] == 0) {
+        return -1;
+    }
+
+    err = construct(&gz->lencode, gz->lengths, nlen);
+    if (err < 0 || (err > 0 && nlen - gz->lencode.count[0] != 1)) {
+        return -1;
+    }
+
+    err = construct(&gz->distcode, gz->lengths + nlen, ndist);
+    if (err < 0 || (err > 0 && ndist - gz->distcode.count[0] != 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int block(gunzip *gz) {
+    int type;
+
+    if (gz->last) {
+        gz->state = GUNZIP_DONE;
+        return 0;
+    }
+
+    gz->last = bits(gz, 1);
+    type = bits(gz, 2);
+
+    switch (type) {
+        case 0: {
+            uint16_t len;
+            uint16_t nlen;
+
+            /* Stored blocks start on a byte boundary */
+            gz->bitbuf = 0;
+            gz->bitcnt = 0;
+            len = byte(gz);
+            len |= byte(gz) << 8;
+            nlen = byte(gz);
+            nlen |= byte(gz) << 8;
+            if ((len ^ nlen) != 0xffff) {
+                return -1;
+            }
+
+            gz->stored_len = len;
+            gz->state = GUNZIP_STORED;
+            return 0;
+        }
+
+        case 1:
+            gz->state = GUNZIP_CODES;
+            return fixed(gz);
+
+        case 2:
+            gz->state = GUNZIP_CODES;
+            return dynamic(gz);
+
+        default:
+            return -1;
+    }
+}
+
+
+static int codes(gunzip *gz, int *out) {
+    int symbol = decode(gz, &gz->lencode);
+    int dist;
+
+    if (symbol < 0) {
+        return -1;
+    }
+
+    if (symbol < 256) {
+        *out = symbol;
+        return 0;
+    }
+
+    *out = -1;
+    if (symbol == 256) {
+        gz->state = GUNZIP_BLOCK;
+        return 0;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) {
+        return -1;
+    }
+
+    gz->copy_len = length_base[symbol] + bits(gz, length_extra[symbol]);
+
+    symbol = decode(gz, &gz->distcode);
+    if (symbol < 0 || symbol >= 30) {
+        return -1;
+    }
+
+    dist = dist_base[symbol] + bits(gz, dist_extra[symbol]);
+    if ((uint32_t)dist > gz->out_pos || dist > gz->window_mask + 1) {
+        /* Too far back, or compressed with a larger window than ours */
+        return -1;
+    }
+
+    gz->copy_dist = dist;
+    return 0;
+}
+
+
+int gunzip_read(gunzip *gz, uint8_t *out, size_t out_len) {
+    size_t n = 0;
+    int c;
+
+    while (n < out_len) {
+        if (gz->copy_len > 0) {
+            c = gz->window[(gz->out_pos - gz->copy_dist) & gz->window_mask];
+            gz->copy_len--;
+        } else {
+            c = -1;
+
+            switch (gz->state) {
+                case GUNZIP_HEADER:
+                    if (header(gz) != 0) {
+                        gz->state = GUNZIP_ERROR;
+                    } else {
+                        gz->state = GUNZIP_BLOCK;
+                    }
+                    break;
+
+                case GUNZIP_BLOCK:
+                    if (block(gz) != 0) {
+                        gz->state = GUNZIP_ERROR;
+                    }
+                    break;
+
+                case GUNZIP_STORED:
+                    if (gz->stored_len == 0) {
+                        gz->state = GUNZIP_BLOCK;
+                    } else {
+                        c = byte(gz);
+                        gz->stored_len--;
+                    }
+                    break;
+
+                case GUNZIP_CODES:
+                    if (codes(gz, &c) != 0) {
+                        gz->state = GUNZIP_ERROR;
+                    }
+                    break;
+
+                case GUNZIP_DONE:
+                    return n;
+
+                case GUNZIP_ERROR:
+                    return n > 0 ? (int)n : -1;
+            }
+
+            if (gz->underrun) {
+                gz->state = GUNZIP_ERROR;
+                continue;
+            }
+
+            if (c < 0) {
+                continue;
+            }
+        }
+
+        gz->window[gz->out_pos++ & gz->window_mask] = c;
+        out[n++] = c;
+    }
+
+    return n;
+}
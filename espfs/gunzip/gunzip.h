@@ -0,0 +1,54 @@
+/*
+ Copyright (c) 2018 Jason Kölker
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef GUNZIP_H
+#define GUNZIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Small streaming gzip decoder for data that is completely addressable in
+   memory (like a mapped ESPFS image). Output is produced in pieces of any
+   size, so the only buffer needed is the 2^window_bits history window the
+   stream was compressed with. */
+
+#define GUNZIP_MIN_WINDOW_BITS 9
+#define GUNZIP_MAX_WINDOW_BITS 15
+
+typedef struct gunzip gunzip;
+
+/* Allocate a decoder for streams compressed with a window of at most
+   2^window_bits bytes. Returns NULL on error. */
+gunzip *gunzip_alloc(uint8_t window_bits);
+
+/* Free a decoder. */
+void gunzip_free(gunzip *gz);
+
+/* Start decoding the gzip stream of in_len bytes at in. */
+void gunzip_reset(gunzip *gz, const uint8_t *in, size_t in_len);
+
+/* Decode up to out_len bytes into out. Returns the number of bytes decoded,
+   0 at the end of the stream or -1 if the stream is corrupt or needs a
+   larger window. */
+int gunzip_read(gunzip *gz, uint8_t *out, size_t out_len);
+
+#endif /* GUNZIP_H */
@@ -0,0 +1,109 @@
+/*
+ Copyright (c) 2018 Jason Kölker
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "lz4.h"
+
+
+/* Reads the extension bytes of a 15 valued length nibble */
+static int lz4_length(const uint8_t **in, const uint8_t *end, size_t *len) {
+    uint8_t b;
+
+    do {
+        if (*in >= end) {
+            return -1;
+        }
+
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+
+    return 0;
+}
+
+
+int lz4_decode_block(const uint8_t *in, size_t in_len, uint8_t *out,
+                     size_t out_len) {
+    const uint8_t *end = in + in_len;
+    uint8_t *op = out;
+    uint8_t *op_end = out + out_len;
+
+    while (in < end) {
+        uint8_t token = *in++;
+        size_t len = token >> 4;
+        size_t offset;
+        const uint8_t *match;
+
+        if (len == 15 && lz4_length(&in, end, &len) != 0) {
+            return -1;
+        }
+
+        if (len > (size_t)(end - in) || len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        memcpy(op, in, len);
+        op += len;
+        in += len;
+
+        /* The last sequence ends with its literals */
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+
+        offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        if (offset == 0 || offset > (size_t)(op - out)) {
+            return -1;
+        }
+
+        len = token & 0xf;
+        if (len == 15 && lz4_length(&in, end, &len) != 0) {
+            return -1;
+        }
+
+        len += 4;
+        if (len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        } else {
+            /* Overlapping matches repeat the last offset
+               bytes, which needs a forward byte copy */
+            while (len-- > 0) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return op - out;
+}
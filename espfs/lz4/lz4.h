@@ -0,0 +1,40 @@
+/*
+ Copyright (c) 2018 Jason Kölker
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Decoder for the LZ4 block format: a series of byte aligned sequences of a
+   token, literals, a 16 bit little endian match offset and match length, the
+   last sequence holding only literals. There is no state beyond the block, so
+   blocks decode independently and at the speed of a memcpy loop. */
+
+/* Decode the in_len bytes of the block at in into out, which holds out_len
+   bytes. Returns the number of bytes decoded or -1 if the block is corrupt
+   or doesn't fit. */
+int lz4_decode_block(const uint8_t *in, size_t in_len, uint8_t *out,
+                     size_t out_len);
+
+#endif /* LZ4_H */
@@ -1,4 +1,4 @@
 //Stupid wraparound include to make sure object file doesn't end up in heatshrink dir
 #ifdef ESPFS_HEATSHRINK
-#include "../heatshrink/heatshrink_encoder.c"
+#include "../heatshrink/heatshrink_decoder.c"
 #endif
@@ -6,17 +6,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
 #ifdef __MINGW32__
 #include <io.h>
+#else
+#include <sys/mman.h>
 #endif
 #include "espfs.h"
 #include "espfsformat.h"
+#include "espfsdefaults.h"
+#include "lz4/lz4.h"
 
 //Heatshrink
 #ifdef ESPFS_HEATSHRINK
 #include "heatshrink_common.h"
 #include "heatshrink_config.h"
-#include "heatshrink_encoder.h"
+#include "heatshrink_decoder.h"
 #endif
 
 //Gzip
@@ -26,6 +33,12 @@
 #include <zlib.h>
 #endif
 
+//Brotli
+#ifdef ESPFS_BROTLI
+// Needs the brotli encoder library, e.g. "sudo apt-get install libbrotli-dev".
+#include <brotli/encode.h>
+#endif
+
 //Cygwin e.a. needs O_BINARY. Don't miscompile if it's not set.
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -48,55 +61,576 @@ int htoxl(int in) {
 	return *((int *)r);
 }
 
+//64-bit FNV-1a hash of the file contents, used to derive the ETag
+uint64_t hashContent(char *data, off_t len) {
+	uint64_t h=0xcbf29ce484222325ULL;
+	off_t i;
+	for (i=0; i<len; i++) {
+		h^=(unsigned char)data[i];
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+//Read exactly len bytes from f. Returns 0 if that fails.
+int readAll(int f, char *buf, off_t len) {
+	ssize_t n;
+	while (len>0) {
+		n=read(f, buf, (len>0x40000000)?0x40000000:len);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) return 0;
+		buf+=n;
+		len-=n;
+	}
+	return 1;
+}
+
+//Map all of the file f into memory (or read it, where files can't be mapped). The file can be
+//closed afterwards. Returns NULL if that fails.
+char *mapFile(int f, off_t *size) {
+	struct stat statBuf;
+	char *data;
+
+	if (fstat(f, &statBuf)!=0) return NULL;
+	*size=statBuf.st_size;
+	if (*size==0) return "";
+#ifdef __MINGW32__
+	data=malloc(*size);
+	if (data!=NULL && !readAll(f, data, *size)) {
+		free(data);
+		data=NULL;
+	}
+#else
+	data=mmap(NULL, *size, PROT_READ, MAP_PRIVATE, f, 0);
+	if (data==MAP_FAILED) data=NULL;
+#endif
+	return data;
+}
+
+void unmapFile(char *data, off_t size) {
+	if (data==NULL || size==0) return;
+#ifdef __MINGW32__
+	free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+char *mapPath(char *path, off_t *size) {
+	char *data;
+	int f=open(path, O_RDONLY|O_BINARY);
+	if (f<0) return NULL;
+	data=mapFile(f, size);
+	close(f);
+	return data;
+}
+
+//The image goes out through this buffer, in writes of this size
+#define OUT_BUFFER_SIZE (1024*1024)
+
+char outBuf[OUT_BUFFER_SIZE];
+int outLen=0;
+
+void writeAll(const char *data, size_t len) {
+	ssize_t n;
+	while (len>0) {
+		n=write(1, data, len);
+		if (n<0 && errno==EINTR) continue;
+		if (n<=0) {
+			perror("writing image");
+			exit(1);
+		}
+		data+=n;
+		len-=n;
+	}
+}
+
+void flushOut() {
+	writeAll(outBuf, outLen);
+	outLen=0;
+}
+
+void writeOut(const void *data, size_t len) {
+	if (outLen+len>OUT_BUFFER_SIZE) flushOut();
+	if (len>=OUT_BUFFER_SIZE) {
+		writeAll(data, len);
+	} else {
+		memcpy(outBuf+outLen, data, len);
+		outLen+=len;
+	}
+}
+
+//Write zeroes up to the next 32-bit boundary after len bytes
+void padOut(int len) {
+	static const char zeroes[4];
+	if (len&3) writeOut(zeroes, 4-(len&3));
+}
+
+//Append an attribute record to buf, padded to a 32-bit boundary. Returns the new length of buf.
+int addAttr(char *buf, int len, int type, const void *val, int valLen) {
+	EspFsAttr a;
+	a.type=htoxs(type);
+	a.len=htoxs(valLen);
+	memcpy(buf+len, &a, sizeof(EspFsAttr));
+	len+=sizeof(EspFsAttr);
+	memcpy(buf+len, val, valLen);
+	len+=valLen;
+	while (len&3) buf[len++]=0;
+	return len;
+}
+
+//Try several compression parameters for every file, keeping what comes out smallest
+int tune=0;
+//Largest heatshrink window bits tuning may pick, so decoding fits in the RAM given with -r
+int tuneWindow=0;
+
 #ifdef ESPFS_HEATSHRINK
-size_t compressHeatshrink(char *in, int insize, char *out, int outsize, int level) {
-	char *inp=in;
-	char *outp=out;
-	size_t len;
+//Shared dictionary heatshrink windows are primed with, and where it is in the image
+char *dict=NULL;
+int dictLen=0;
+long dictPos;
+
+//Files up to this size are the samples the dictionary is built from
+#define DICT_SAMPLE_SIZE 8192
+#define DICT_SAMPLES_TOTAL (1024*1024)
+#define DICT_KMER 6
+#define DICT_SEGMENT 32
+#define DICT_HASH_BITS 18
+
+uint32_t dictHash(unsigned char *p) {
+	uint32_t h=0;
+	int i;
+	for (i=0; i<DICT_KMER; i++) h=(h*31)+p[i];
+	return (h*2654435761U)>>(32-DICT_HASH_BITS);
+}
+
+//Build a dictionary of up to len bytes from the segments of the samples whose substrings occur in
+//the most other samples, greedily taking the best segment and discounting what it covers. The
+//best segments go last, at the smallest distances from the data.
+int buildDictionary(char **samples, int *sizes, int n, char *out, int len) {
+	uint16_t *freq=calloc(1<<DICT_HASH_BITS, sizeof(uint16_t));
+	int *stamp=calloc(1<<DICT_HASH_BITS, sizeof(int));
+	int i, p, j, score, bestScore, best, bestPos, used=0;
+	unsigned char *d;
+
+	for (i=0; i<n; i++) {
+		d=(unsigned char *)samples[i];
+		for (p=0; p+DICT_KMER<=sizes[i]; p++) {
+			j=dictHash(d+p);
+			if (stamp[j]!=i+1) {
+				stamp[j]=i+1;
+				if (freq[j]<0xffff) freq[j]++;
+			}
+		}
+	}
+
+	//Substrings of a single sample don't help any other file
+	for (j=0; j<(1<<DICT_HASH_BITS); j++) {
+		if (freq[j]<2) freq[j]=0;
+	}
+
+	while (used+DICT_SEGMENT<=len) {
+		bestScore=0;
+		best=-1;
+		bestPos=0;
+		for (i=0; i<n; i++) {
+			d=(unsigned char *)samples[i];
+			if (sizes[i]<DICT_SEGMENT) continue;
+			score=0;
+			for (p=0; p<=DICT_SEGMENT-DICT_KMER; p++) score+=freq[dictHash(d+p)];
+			for (p=0; ; p++) {
+				if (score>bestScore) {
+					bestScore=score;
+					best=i;
+					bestPos=p;
+				}
+				if (p+DICT_SEGMENT>=sizes[i]) break;
+				score-=freq[dictHash(d+p)];
+				score+=freq[dictHash(d+p+DICT_SEGMENT-DICT_KMER+1)];
+			}
+		}
+		if (best<0) break;
+		d=(unsigned char *)samples[best]+bestPos;
+		for (p=0; p<=DICT_SEGMENT-DICT_KMER; p++) freq[dictHash(d+p)]=0;
+		used+=DICT_SEGMENT;
+		memcpy(out+len-used, d, DICT_SEGMENT);
+	}
+
+	memmove(out, out+len-used, used);
+	free(freq);
+	free(stamp);
+	return used;
+}
+
+//Heatshrink parameters of a compression level (-1 for the default): the window bits<<4 and the
+//lookahead bits, as stored in the first byte of the data.
+int heatshrinkParams(int level) {
 	int ws[]={5, 6, 8, 11, 13};
 	int ls[]={3, 3, 4, 4, 4};
-	HSE_poll_res pres;
-	HSE_sink_res sres;
-	size_t r;
 	if (level==-1) level=8;
 	level=(level-1)/2; //level is now 0, 1, 2, 3, 4
-	heatshrink_encoder *enc=heatshrink_encoder_alloc(ws[level], ls[level]);
-	if (enc==NULL) {
+	return (ws[level]<<4)|ls[level];
+}
+
+//Worst case size of the heatshrink data of insize bytes in nblocks blocks: every byte a 9 bit
+//literal, the parameter byte and a partial byte at the end of every block.
+int heatshrinkBound(int insize, int nblocks) {
+	return insize+insize/8+nblocks+8;
+}
+
+//Heatshrink bit stream being written: bits are packed most significant first.
+typedef struct {
+	unsigned char *out;
+	int size;
+	int len;
+	int bits;
+	int bitCount;
+} HsBits;
+
+void hsPutBits(HsBits *b, int val, int count) {
+	while (count>0) {
+		b->bits=(b->bits<<1)|((val>>(--count))&1);
+		if (++b->bitCount==8) {
+			if (b->len==b->size) {
+				fprintf(stderr, "Heatshrink: Bug? output doesn't fit in %d bytes\n", b->len);
+				exit(1);
+			}
+			b->out[b->len++]=b->bits;
+			b->bits=0;
+			b->bitCount=0;
+		}
+	}
+}
+
+//Matches are looked up by the 2 bytes they start with, trying at most this many earlier
+//positions starting with them, nearest first.
+#define HS_HASH_SIZE 65536
+#define HS_MAX_CHAIN 4096
+
+//Match finder state of a heatshrink encode. head holds the last position of every 2 byte hash
+//plus base, so entries of earlier blocks (which have a lower base) read as negative, which ends
+//the chain, without clearing head for every block.
+typedef struct {
+	int ws;
+	int ls;
+	int base;
+	int *head;
+	int *prev;
+	int *cost;
+	int *from;
+	int *dist;
+} HsMatcher;
+
+//Encode the n bytes at buf+window into b; buf[0..window) holds what the decoder window starts
+//out with, of which only matches starting from start on need to be looked at. The embedded
+//encoder takes the longest match it finds at every step. Here the longest match at every
+//position feeds a shortest path over the whole block instead: a back reference costs the same
+//number of bits whatever its length and distance, so the cheapest parse only needs those.
+void hsEncodeBlock(HsBits *b, HsMatcher *m, unsigned char *buf, int start, int window, int n) {
+	int end=window+n;
+	int maxLen=1<<m->ls;
+	int refBits=1+m->ws+m->ls;
+	int *cost=m->cost, *from=m->from, *dist=m->dist;
+	int lastDist=0;
+	int i, j, l, p, h;
+
+	cost[0]=0;
+	for (i=1; i<=n; i++) cost[i]=INT32_MAX;
+	for (p=start; p<end; p++) {
+		i=p-window;
+		if (i>=0) {
+			//Everything ending here has been tried, cost[i] is final
+			if (cost[i]+9<cost[i+1]) {
+				cost[i+1]=cost[i]+9;
+				from[i+1]=1;
+			}
+		}
+		if (p==end-1) break;
+		h=(buf[p]<<8)|buf[p+1];
+		if (i>=0) {
+			int lim=(end-p<maxLen)?end-p:maxLen;
+			int bestLen=0, chain=HS_MAX_CHAIN;
+			//Repetitive data mostly matches at the distance of the match before, try that first
+			j=p-lastDist;
+			if (lastDist>0 && j>=start) {
+				for (l=0; l<lim && buf[j+l]==buf[p+l]; l++) ;
+				if (l>=2) bestLen=l;
+			}
+			if (bestLen==lim) chain=0;
+			//A match may run into the bytes it copies, the decoder copies one byte at a time
+			for (j=m->head[h]-m->base; j>=0 && p-j<=window && chain-->0; j=m->prev[j]) {
+				if (buf[j+bestLen]!=buf[p+bestLen]) continue;
+				for (l=2; l<lim && buf[j+l]==buf[p+l]; l++) ;
+				if (l>bestLen) {
+					bestLen=l;
+					lastDist=p-j;
+					if (l==lim) break;
+				}
+			}
+			for (l=2; l<=bestLen; l++) {
+				if (cost[i]+refBits<cost[i+l]) {
+					cost[i+l]=cost[i]+refBits;
+					from[i+l]=l;
+					dist[i+l]=lastDist;
+				}
+			}
+		}
+		m->prev[p]=m->head[h]-m->base;
+		m->head[h]=p+m->base;
+	}
+	m->base+=end;
+
+	//Walk the path back, leaving where the step starting at i ends in cost[i]
+	for (i=n; i>0; i-=l) {
+		l=from[i];
+		cost[i-l]=i;
+	}
+	for (i=0; i<n; i=j) {
+		j=cost[i];
+		if (j-i==1) {
+			hsPutBits(b, 1, 1);
+			hsPutBits(b, buf[window+i], 8);
+		} else {
+			hsPutBits(b, 0, 1);
+			hsPutBits(b, dist[j]-1, m->ws);
+			hsPutBits(b, j-i-1, m->ls);
+		}
+	}
+	//Pad the last byte with zeroes, the decoder takes them for a back reference that never ends
+	if (b->bitCount>0) hsPutBits(b, 0, 8-b->bitCount);
+}
+
+//Decode the len bytes of heatshrink data at data with the decoder the device uses, its window
+//primed with the end of dict like the encoder's was, and check that gives the n bytes at expect.
+int hsCheckBlock(unsigned char *data, int len, int params, char *dict, int primed,
+		unsigned char *expect, int n) {
+	heatshrink_decoder *dec=heatshrink_decoder_alloc(256, params>>4, params&15);
+	unsigned char *out=malloc(n+1);
+	size_t count, got=0;
+	int sunk=0, ok;
+	HSD_poll_res pres;
+
+	if (dec==NULL || out==NULL) {
+		perror("allocating mem for heatshrink");
+		exit(1);
+	}
+	if (primed>0) {
+		memcpy(dec->buffers+HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(dec)+(1<<(params>>4))-primed,
+				dict, primed);
+	}
+	do {
+		if (sunk<len) {
+			heatshrink_decoder_sink(dec, data+sunk, len-sunk, &count);
+			sunk+=count;
+		}
+		do {
+			pres=heatshrink_decoder_poll(dec, out+got, n+1-got, &count);
+			got+=count;
+		} while (pres==HSDR_POLL_MORE && got<n+1);
+	} while (sunk<len && got<n+1);
+	ok=(got==n && memcmp(out, expect, n)==0);
+	heatshrink_decoder_free(dec);
+	free(out);
+	return ok;
+}
+
+//Compress in into out with the heatshrink parameters params. If blockSize is non-zero the input
+//is cut in blocks of blockSize bytes that are compressed independently, and the offset of every
+//block is stored in blockOffs. With a dictionary, the encoder window starts out with the end of
+//it instead of zeroes. Every block is decoded again to check it.
+size_t compressHeatshrink(char *in, int insize, char *out, int outsize, int params,
+		int blockSize, int32_t *blockOffs, char *dict, int dictLen) {
+	int window=1<<(params>>4);
+	int blockLen=(blockSize>0 && blockSize<insize)?blockSize:insize;
+	int primed=(dictLen>window)?window:dictLen;
+	//Any zeroes before the dictionary beyond a longest match don't make for other matches
+	int start=window-primed-(1<<(params&15))-1;
+	int block=0, n, i, pos;
+	unsigned char *buf=malloc(window+blockLen);
+	HsMatcher m;
+	HsBits b={(unsigned char *)out, outsize, 0, 0, 0};
+	m.ws=params>>4;
+	m.ls=params&15;
+	m.base=0;
+	m.head=malloc(HS_HASH_SIZE*sizeof(int));
+	m.prev=malloc((window+blockLen)*sizeof(int));
+	m.cost=malloc((blockLen+1)*sizeof(int));
+	m.from=malloc((blockLen+1)*sizeof(int));
+	m.dist=malloc((blockLen+1)*sizeof(int));
+	if (buf==NULL || m.head==NULL || m.prev==NULL || m.cost==NULL || m.from==NULL || m.dist==NULL) {
 		perror("allocating mem for heatshrink");
 		exit(1);
 	}
+	if (start<0) start=0;
+	for (i=0; i<HS_HASH_SIZE; i++) m.head[i]=-1;
+	memset(buf, 0, window);
+	if (primed>0) memcpy(buf+window-primed, dict+dictLen-primed, primed);
 	//Save encoder parms as first byte
-	*outp=(ws[level]<<4)|ls[level];
-	outp++; outsize--;
+	hsPutBits(&b, params, 8);
 
-	r=1;
 	do {
-		if (insize>0) {
-			sres=heatshrink_encoder_sink(enc, inp, insize, &len);
-			if (sres!=HSER_SINK_OK) break;
-			inp+=len; insize-=len;
-			if (insize==0) heatshrink_encoder_finish(enc);
+		n=(insize>blockLen)?blockLen:insize;
+		if (blockSize>0) blockOffs[block++]=htoxl(b.len);
+		memcpy(buf+window, in, n);
+		pos=b.len;
+		hsEncodeBlock(&b, &m, buf, start, window, n);
+		if (!hsCheckBlock((unsigned char *)out+pos, b.len-pos, params, dict+dictLen-primed, primed,
+				(unsigned char *)in, n)) {
+			fprintf(stderr, "Heatshrink: Bug? block at %d doesn't decode\n", block);
+			exit(1);
 		}
-		do {
-			pres=heatshrink_encoder_poll(enc, outp, outsize, &len);
-			if (pres!=HSER_POLL_MORE && pres!=HSER_POLL_EMPTY) break;
-			outp+=len; outsize-=len;
-			r+=len;
-		} while (pres==HSER_POLL_MORE);
+		in+=n; insize-=n;
 	} while (insize!=0);
 
-	if (insize!=0) {
-		fprintf(stderr, "Heatshrink: Bug? insize is still %d. sres=%d pres=%d\n", insize, sres, pres);
-		exit(1);
+	free(buf);
+	free(m.head);
+	free(m.prev);
+	free(m.cost);
+	free(m.from);
+	free(m.dist);
+	return b.len;
+}
+
+//Compress with every window of up to maxWindow bits and the lookaheads that go with it,
+//leaving the smallest result (with its block offsets) in out.
+size_t compressHeatshrinkTuned(char *in, int insize, char *out, int outsize, int maxWindow,
+		int blockSize, int32_t *blockOffs, int nblocks, char *dict, int dictLen) {
+	char *tmp=malloc(outsize);
+	int32_t *tmpOffs=malloc(nblocks*sizeof(int32_t)+1);
+	size_t best=0, len;
+	int w, l;
+
+	for (w=HEATSHRINK_MIN_WINDOW_BITS; w<=maxWindow; w++) {
+		for (l=HEATSHRINK_MIN_LOOKAHEAD_BITS; l<w && l<=8; l++) {
+			len=compressHeatshrink(in, insize, tmp, outsize, (w<<4)|l, blockSize, tmpOffs, dict,
+					dictLen);
+			if (best==0 || len<best) {
+				best=len;
+				memcpy(out, tmp, len);
+				if (nblocks>0) memcpy(blockOffs, tmpOffs, nblocks*sizeof(int32_t));
+			}
+		}
+	}
+	free(tmp);
+	free(tmpOffs);
+	return best;
+}
+#endif
+
+//LZ4 blocks decompress to this many bytes, which is what the device needs to buffer per file
+int lz4BlockSize=2048;
+
+//Use LZ4 instead of heatshrink for files it compresses at most this many percent bigger, -1 for never
+int lz4Slack=-1;
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+
+//Worst case size of the LZ4 data of insize bytes
+int lz4Bound(int insize) {
+	return insize+insize/255+16*((insize+lz4BlockSize-1)/lz4BlockSize+1);
+}
+
+uint32_t lz4Read32(unsigned char *p) {
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+//Write an LZ4 length nibble's extension bytes
+unsigned char *lz4Length(unsigned char *out, int len) {
+	while (len>=255) {
+		*out++=255;
+		len-=255;
+	}
+	*out++=len;
+	return out;
+}
+
+//Write one sequence: the literals from lit up to match, then the match (if len isn't 0)
+unsigned char *lz4Sequence(unsigned char *out, unsigned char *lit, unsigned char *match,
+		int offset, int len) {
+	int litLen=match-lit;
+	unsigned char *token=out++;
+	*token=((litLen>=15)?15:litLen)<<4;
+	if (litLen>=15) out=lz4Length(out, litLen-15);
+	memcpy(out, lit, litLen);
+	out+=litLen;
+	if (len==0) return out;
+	*out++=offset;
+	*out++=offset>>8;
+	len-=LZ4_MIN_MATCH;
+	*token|=(len>=15)?15:len;
+	if (len>=15) out=lz4Length(out, len-15);
+	return out;
+}
+
+//Greedy LZ4 compression of one block with a hash table of the last position of every 4 byte
+//sequence. Like the reference encoder, the last 5 bytes are always literals and no match starts
+//in the last 12, so any LZ4 decoder takes the output.
+int compressLz4Block(unsigned char *in, int insize, unsigned char *out) {
+	int table[1<<LZ4_HASH_BITS];
+	unsigned char *ip=in, *anchor=in, *op=out;
+	unsigned char *mflimit=in+insize-12, *matchlimit=in+insize-5;
+	unsigned char *ref;
+	uint32_t seq;
+	int h, len;
+
+	memset(table, 0xff, sizeof(table));
+	while (insize>=13 && ip<mflimit) {
+		seq=lz4Read32(ip);
+		h=(seq*2654435761U)>>(32-LZ4_HASH_BITS);
+		ref=(table[h]<0)?NULL:in+table[h];
+		table[h]=ip-in;
+		if (ref==NULL || ip-ref>65535 || lz4Read32(ref)!=seq) {
+			ip++;
+			continue;
+		}
+		while (ip>anchor && ref>in && ip[-1]==ref[-1]) {
+			ip--;
+			ref--;
+		}
+		len=LZ4_MIN_MATCH;
+		while (ip+len<matchlimit && ip[len]==ref[len]) len++;
+		op=lz4Sequence(op, anchor, ip, ip-ref, len);
+		ip+=len;
+		anchor=ip;
 	}
+	op=lz4Sequence(op, anchor, in+insize, 0, 0);
+	return op-out;
+}
 
-	heatshrink_encoder_free(enc);
+//Compress in into out as independent LZ4 blocks of blockSize bytes, storing the offset of every
+//block in blockOffs. Every block is decoded again to check it.
+size_t compressLz4(char *in, int insize, char *out, int blockSize, int32_t *blockOffs) {
+	char *check=malloc(blockSize);
+	int pos, len, clen;
+	size_t r=0;
+	for (pos=0; pos<insize; pos+=blockSize) {
+		len=(insize-pos>blockSize)?blockSize:insize-pos;
+		*blockOffs++=htoxl(r);
+		clen=compressLz4Block((unsigned char *)in+pos, len, (unsigned char *)out+r);
+		if (lz4_decode_block((uint8_t *)out+r, clen, (uint8_t *)check, len)!=len ||
+				memcmp(check, in+pos, len)!=0) {
+			fprintf(stderr, "LZ4: Bug? block at %d doesn't decode\n", pos);
+			exit(1);
+		}
+		r+=clen;
+	}
+	free(check);
 	return r;
 }
-#endif
 
 #ifdef ESPFS_GZIP
-size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
+int gzipWindowBits=15;
+
+//Worst case size of gzip data of insize bytes with any of the deflate settings used here
+int gzipBound(int insize) {
+	return insize+insize/8+insize/64+64;
+}
+
+//Level 9 with the longest searches zlib can do
+#define GZIP_LEVEL_EXHAUSTIVE 10
+
+size_t compressGzip(char *in, int insize, char *out, int outsize, int level, int strategy) {
 	z_stream stream;
 	int zresult;
 
@@ -107,8 +641,13 @@ size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
 	stream.avail_in = insize;
 	stream.next_out = out;
 	stream.avail_out = outsize;
-	// 31 -> 15 window bits + 16 for gzip
-	zresult = deflateInit2 (&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+	// +16 for gzip. A smaller window keeps the RAM needed to inflate on the device down.
+	if (level==GZIP_LEVEL_EXHAUSTIVE) {
+		zresult = deflateInit2 (&stream, 9, Z_DEFLATED, gzipWindowBits+16, 9, strategy);
+		if (zresult == Z_OK) zresult = deflateTune(&stream, 258, 258, 258, 4096);
+	} else {
+		zresult = deflateInit2 (&stream, level, Z_DEFLATED, gzipWindowBits+16, 8, strategy);
+	}
 	if (zresult != Z_OK) {
 		fprintf(stderr, "DeflateInit2 failed with code %d\n", zresult);
 		exit(1);
@@ -129,6 +668,49 @@ size_t compressGzip(char *in, int insize, char *out, int outsize, int level) {
 	return stream.total_out;
 }
 
+//Deflate as hard as zlib can with the strategies that suit text, leaving the smallest in out.
+size_t compressGzipTuned(char *in, int insize, char *out, int outsize) {
+	int levels[]={9, GZIP_LEVEL_EXHAUSTIVE, GZIP_LEVEL_EXHAUSTIVE};
+	int strategies[]={Z_DEFAULT_STRATEGY, Z_DEFAULT_STRATEGY, Z_FILTERED};
+	char *tmp=malloc(outsize);
+	size_t best=0, len;
+	int i;
+
+	for (i=0; i<3; i++) {
+		len=compressGzip(in, insize, tmp, outsize, levels[i], strategies[i]);
+		if (best==0 || len<best) {
+			best=len;
+			memcpy(out, tmp, len);
+		}
+	}
+	free(tmp);
+	return best;
+}
+
+#define ENCODING_GZIP (1<<0)
+#define ENCODING_BROTLI (1<<1)
+
+//Encodings stored as variants next to the plain file instead of replacing it
+int variantEncodings=0;
+
+int parseEncodings(char *input) {
+	char *token=strtok(input, ",");
+	while (token) {
+		if (strcmp(token, "gzip")==0) {
+			variantEncodings|=ENCODING_GZIP;
+#ifdef ESPFS_BROTLI
+		} else if (strcmp(token, "br")==0) {
+			variantEncodings|=ENCODING_BROTLI;
+#endif
+		} else {
+			fprintf(stderr, "Unknown encoding - %s\n", token);
+			return 0;
+		}
+		token=strtok(NULL, ",");
+	}
+	return 1;
+}
+
 char **gzipExtensions = NULL;
 
 int shouldCompressGzip(char *name) {
@@ -180,191 +762,3059 @@ int parseGzipExtensions(char *input) {
 }
 #endif
 
-int handleFile(int f, char *name, int compression, int level, char **compName) {
-	char *fdat, *cdat;
-	off_t size, csize;
-	EspFsHeader h;
-	int nameLen;
-	int8_t flags = 0;
-	size=lseek(f, 0, SEEK_END);
-	fdat=malloc(size);
-	lseek(f, 0, SEEK_SET);
-	read(f, fdat, size);
-	
-
-#ifdef ESPFS_GZIP
-	if (shouldCompressGzip(name)) {
-		csize = size*3;
-		if (csize<100) // gzip has some headers that do not fit when trying to compress small files
-			csize = 100; // enlarge buffer if this is the case
-		cdat=malloc(csize);
-		csize=compressGzip(fdat, size, cdat, csize, level);
-		compression = COMPRESS_NONE;
-		flags = FLAG_GZIP;
-	} else
-#endif
-	if (compression==COMPRESS_NONE) {
-		csize=size;
-		cdat=fdat;
-#ifdef ESPFS_HEATSHRINK
-	} else if (compression==COMPRESS_HEATSHRINK) {
-		cdat=malloc(size*2);
-		csize=compressHeatshrink(fdat, size, cdat, size*2, level);
-#endif
-	} else {
-		fprintf(stderr, "Unknown compression - %d\n", compression);
+#ifdef ESPFS_BROTLI
+size_t compressBrotli(char *in, int insize, char *out, int outsize) {
+	size_t len=outsize;
+	if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+			insize, (uint8_t *)in, &len, (uint8_t *)out)) {
+		fprintf(stderr, "Brotli compression failed\n");
 		exit(1);
 	}
+	return len;
+}
+#endif
 
-	if (csize>size) {
-		//Compressing enbiggened this file. Revert to uncompressed store.
-		compression=COMPRESS_NONE;
-		csize=size;
-		cdat=fdat;
-		flags=0;
-	}
+#define CODEC_HEATSHRINK 1
+#define CODEC_LZ4 2
+#define CODEC_GZIP 3
+#define CODEC_BROTLI 4
+#define CODEC_HEATSHRINK_TUNED 5
+#define CODEC_GZIP_TUNED 6
 
-	//Fill header data
-	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
-	h.flags=flags;
-	h.compression=compression;
-	h.nameLen=nameLen=strlen(name)+1;
-	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
-	h.nameLen=htoxs(h.nameLen);
-	h.fileLenComp=htoxl(csize);
-	h.fileLenDecomp=htoxl(size);
-	
-	write(1, &h, sizeof(EspFsHeader));
-	write(1, name, nameLen);
-	while (nameLen&3) {
-		write(1, "\000", 1);
-		nameLen++;
+//Bump when an encoder changes its output, so cached results of the old one aren't used
+#define RESULT_VERSION 3
+#define RESULT_BUCKETS 4096
+
+//Compression results, by a hash of the input and everything else that goes into them. With
+//several jobs, the files are first compressed on that many threads, which fills this cache;
+//the image is then written in list order from it, so it doesn't depend on which thread
+//finished first. With a cache directory the results are also kept there for the next build.
+typedef struct Result {
+	uint64_t key;
+	char *data;
+	size_t len;
+	int32_t *offs; //block offsets, if the codec has them
+	int nOffs;
+	struct Result *next;
+} Result;
+
+Result *results[RESULT_BUCKETS];
+pthread_mutex_t resultLock=PTHREAD_MUTEX_INITIALIZER;
+char *cacheDir=NULL;
+int jobs=0;
+int prefetching=0; //compressing ahead on the job threads, nothing is written
+
+Result *findResult(uint64_t key) {
+	Result *r;
+	pthread_mutex_lock(&resultLock);
+	for (r=results[key%RESULT_BUCKETS]; r!=NULL && r->key!=key; r=r->next);
+	pthread_mutex_unlock(&resultLock);
+	return r;
+}
+
+void freeResult(Result *r) {
+	free(r->data);
+	free(r->offs);
+	free(r);
+}
+
+//Add r to the cache, unless another thread got there first. Returns the one in the cache.
+Result *addResult(Result *r) {
+	Result *e;
+	pthread_mutex_lock(&resultLock);
+	for (e=results[r->key%RESULT_BUCKETS]; e!=NULL && e->key!=r->key; e=e->next);
+	if (e==NULL) {
+		r->next=results[r->key%RESULT_BUCKETS];
+		results[r->key%RESULT_BUCKETS]=r;
 	}
-	write(1, cdat, csize);
-	//Pad out to 32bit boundary
-	while (csize&3) {
-		write(1, "\000", 1);
-		csize++;
+	pthread_mutex_unlock(&resultLock);
+	if (e!=NULL) {
+		freeResult(r);
+		return e;
 	}
-	free(fdat);
+	return r;
+}
 
-	if (compName != NULL) {
-		if (h.compression==COMPRESS_HEATSHRINK) {
-			*compName = "heatshrink";
-		} else if (h.compression==COMPRESS_NONE) {
-			if (h.flags & FLAG_GZIP) {
-				*compName = "gzip";
-			} else {
-				*compName = "none";
-			}
-		} else {
-			*compName = "unknown";
+//Cache files hold the length, the number of block offsets, the offsets and the data.
+Result *loadResult(uint64_t key, int nOffs) {
+	char path[1024];
+	Result *r;
+	int32_t hdr[2];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%016llx", cacheDir, (unsigned long long)key);
+	f=fopen(path, "rb");
+	if (f==NULL) return NULL;
+	r=calloc(1, sizeof(Result));
+	r->key=key;
+	if (fread(hdr, sizeof(hdr), 1, f)==1 && hdr[0]>=0 && hdr[1]==nOffs) {
+		r->len=hdr[0];
+		r->nOffs=nOffs;
+		r->offs=malloc(nOffs*sizeof(int32_t)+1);
+		r->data=malloc(r->len+1);
+		if (fread(r->offs, sizeof(int32_t), nOffs, f)==(size_t)nOffs &&
+				fread(r->data, 1, r->len, f)==r->len && fgetc(f)==EOF) {
+			fclose(f);
+			return r;
 		}
 	}
-	return size ? (csize*100)/size : 100;
+	fprintf(stderr, "Ignoring broken cache file %s\n", path);
+	fclose(f);
+	free(r->offs);
+	free(r->data);
+	free(r);
+	return NULL;
 }
 
-//Write final dummy header with FLAG_LASTFILE set.
-void finishArchive() {
-	EspFsHeader h;
-	h.magic=('E'<<0)+('S'<<8)+('f'<<16)+('s'<<24);
-	h.flags=FLAG_LASTFILE;
-	h.compression=COMPRESS_NONE;
-	h.nameLen=htoxs(0);
-	h.fileLenComp=htoxl(0);
-	h.fileLenDecomp=htoxl(0);
-	write(1, &h, sizeof(EspFsHeader));
+//Write r to the cache directory, through a temporary file so a reader never sees half of it.
+//Returns 0 if that fails.
+int storeResult(Result *r) {
+	char path[1024], tmp[1100];
+	int32_t hdr[2]={r->len, r->nOffs};
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%016llx", cacheDir, (unsigned long long)r->key);
+	snprintf(tmp, sizeof(tmp), "%s.%d.%p", path, (int)getpid(), (void *)r);
+	f=fopen(tmp, "wb");
+	if (f==NULL) {
+		perror(tmp);
+		return 0;
+	}
+	if (fwrite(hdr, sizeof(hdr), 1, f)!=1 ||
+			fwrite(r->offs, sizeof(int32_t), r->nOffs, f)!=(size_t)r->nOffs ||
+			fwrite(r->data, 1, r->len, f)!=r->len || fclose(f)!=0 || rename(tmp, path)!=0) {
+		perror(tmp);
+		unlink(tmp);
+		return 0;
+	}
+	return 1;
 }
 
-int main(int argc, char **argv) {
-	int f, x;
-	char fileName[1024];
-	char *realName;
-	struct stat statBuf;
-	int serr;
-	int rate;
-	int err=0;
-	int compType;  //default compression type - heatshrink
-	int compLvl=-1;
+//Compress in with codec into out, which has room for outsize bytes, and its nOffs block offsets
+//(for heatshrink with blockSize, and LZ4) into offs. level is the gzip level, the heatshrink
+//parameters, or the largest window bits for tuned heatshrink. Results come from the cache when
+//possible. With a cache directory, results are read back from there instead of being kept in
+//memory, so the memory used doesn't grow with the image.
+size_t compressCached(int codec, char *in, int insize, char *out, int outsize, int level,
+		int blockSize, int32_t *offs, int nOffs, char *dict, int dictLen) {
+	uint64_t params[8];
+	Result *r;
+	uint64_t key;
+	int kept=1; //r is in the memory cache
+	size_t len;
 
-#ifdef __MINGW32__
-	setmode(fileno(stdout), O_BINARY);
-#endif
-#ifdef ESPFS_HEATSHRINK
-	compType = COMPRESS_HEATSHRINK;
+	params[0]=RESULT_VERSION;
+	params[1]=codec;
+	params[2]=hashContent(in, insize);
+	params[3]=insize;
+	params[4]=level;
+	params[5]=blockSize;
+	params[6]=dictLen?hashContent(dict, dictLen):0;
+#ifdef ESPFS_GZIP
+	params[7]=(codec==CODEC_GZIP || codec==CODEC_GZIP_TUNED)?gzipWindowBits:0;
 #else
-	compType = COMPRESS_NONE;
+	params[7]=0;
 #endif
+	key=hashContent((char *)params, sizeof(params));
 
-	for (x=1; x<argc; x++) {
-		if (strcmp(argv[x], "-c")==0 && argc>=x-2) {
-			compType=atoi(argv[x+1]);
-			x++;
-		} else if (strcmp(argv[x], "-l")==0 && argc>=x-2) {
-			compLvl=atoi(argv[x+1]);
-			if (compLvl<1 || compLvl>9) err=1;
-			x++;
+	r=findResult(key);
+	if (r==NULL && cacheDir!=NULL) {
+		r=loadResult(key, nOffs);
+		kept=0;
+	}
+	if (r==NULL) {
+		r=calloc(1, sizeof(Result));
+		r->key=key;
+		r->data=malloc(outsize);
+		r->nOffs=nOffs;
+		r->offs=malloc(nOffs*sizeof(int32_t)+1);
+		if (codec==CODEC_LZ4) {
+			r->len=compressLz4(in, insize, r->data, blockSize, r->offs);
+#ifdef ESPFS_HEATSHRINK
+		} else if (codec==CODEC_HEATSHRINK) {
+			r->len=compressHeatshrink(in, insize, r->data, outsize, level, blockSize, r->offs,
+					dict, dictLen);
+		} else if (codec==CODEC_HEATSHRINK_TUNED) {
+			r->len=compressHeatshrinkTuned(in, insize, r->data, outsize, level, blockSize, r->offs,
+					nOffs, dict, dictLen);
+#endif
 #ifdef ESPFS_GZIP
-		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
-			if (!parseGzipExtensions(argv[x+1])) err=1;
-			x++;
+		} else if (codec==CODEC_GZIP) {
+			r->len=compressGzip(in, insize, r->data, outsize, level, Z_DEFAULT_STRATEGY);
+		} else if (codec==CODEC_GZIP_TUNED) {
+			r->len=compressGzipTuned(in, insize, r->data, outsize);
+#endif
+#ifdef ESPFS_BROTLI
+		} else if (codec==CODEC_BROTLI) {
+			r->len=compressBrotli(in, insize, r->data, outsize);
 #endif
-		} else {
-			err=1;
 		}
+		kept=(cacheDir==NULL || !storeResult(r));
+		if (kept) r=addResult(r);
 	}
 
-#ifdef ESPFS_GZIP
-	if (gzipExtensions == NULL) {
-		parseGzipExtensions(strdup("html,css,js,svg"));
+	if (r->len>(size_t)outsize) {
+		fprintf(stderr, "Cached result %016llx doesn't fit\n", (unsigned long long)key);
+		exit(1);
+	}
+	memcpy(out, r->data, r->len);
+	if (nOffs>0) memcpy(offs, r->offs, nOffs*sizeof(int32_t));
+	len=r->len;
+	if (!kept) freeResult(r);
+	return len;
+}
+
+//Files an earlier stage renamed or changed the contents of
+typedef struct {
+	char *path; //as in the file list
+	char *name; //stored as
+	char *data; //NULL if unchanged
+	off_t size;
+	int fingerprinted;
+	int refersFingerprinted; //references fingerprinted files, so must not be cached for long
+	int generated; //not in the html directory, made up by a stage
+} Asset;
+
+Asset *assets=NULL;
+int assetCount=0;
+
+Asset *findAsset(char *path) {
+	int i;
+	for (i=0; i<assetCount; i++) {
+		if (strcmp(assets[i].path, path)==0) return &assets[i];
+	}
+	return NULL;
+}
+
+Asset *assetByName(char *name) {
+	int i;
+	for (i=0; i<assetCount; i++) {
+		if (strcmp(assets[i].name, name)==0) return &assets[i];
+	}
+	return NULL;
+}
+
+//Name a file from the list has in the html directory (and is traced by, when not fingerprinted)
+char *sourceName(char *name) {
+	if (name[0]=='.') name++;
+	if (name[0]=='/') name++;
+	return name;
+}
+
+//Name a file from the list is stored by
+char *storedName(char *name) {
+	Asset *a=findAsset(name);
+	return (a!=NULL)?a->name:sourceName(name);
+}
+
+Asset *addAsset(char *path) {
+	Asset *a=findAsset(path);
+	if (a!=NULL) return a;
+	assets=realloc(assets, (assetCount+1)*sizeof(Asset));
+	if (assets==NULL) {
+		perror("allocating assets");
+		exit(1);
+	}
+	a=&assets[assetCount++];
+	a->path=strdup(path);
+	a->name=strdup(sourceName(path));
+	a->data=NULL;
+	a->size=0;
+	a->fingerprinted=0;
+	a->refersFingerprinted=0;
+	a->generated=0;
+	return a;
+}
+
+//Contents the file at path goes into the image with: what an earlier stage made of it, or else
+//the file mapped into memory. Returns NULL if it can't be read.
+char *loadFile(char *path, off_t *size) {
+	Asset *a=findAsset(path);
+	if (a!=NULL && a->data!=NULL) {
+		*size=a->size;
+		return a->data;
+	}
+	return mapPath(path, size);
+}
+
+void unloadFile(char *path, char *data, off_t size) {
+	Asset *a=findAsset(path);
+	if (a==NULL || a->data!=data) unmapFile(data, size);
+}
+
+//Whether path from the list is a file to store: a regular file, or one a stage made up
+int isFile(char *path) {
+	struct stat statBuf;
+	Asset *a=findAsset(path);
+	if (a!=NULL && a->generated) return 1;
+	return stat(path, &statBuf)==0 && S_ISREG(statBuf.st_mode);
+}
+
+int isReadable(char *path) {
+	Asset *a=findAsset(path);
+	return (a!=NULL && a->generated) || access(path, R_OK)==0;
+}
+
+void freeAssets() {
+	int i;
+	for (i=0; i<assetCount; i++) {
+		free(assets[i].path);
+		free(assets[i].name);
+		free(assets[i].data);
+	}
+	free(assets);
+}
+
+//How a file is stored and served, as set by the manifest; -1 or NULL where it doesn't say
+typedef struct {
+	int compression;
+	int level;
+	int gzip;
+	char *cache;
+	char *mime;
+	char *aliases; //comma separated names the file is also served under
+	int fingerprint;
+	int minify;
+	int inlined;
+	int precache;
+} Policy;
+
+typedef struct {
+	char *pattern;
+	Policy policy;
+} Rule;
+
+Rule *rules=NULL;
+int ruleCount=0;
+
+#define CACHE_IMMUTABLE "max-age=31536000, immutable"
+
+//Match name against a glob: * matches anything but a '/', ** anything at all, ? one character
+//other than '/'.
+int globMatch(char *pat, char *name) {
+	if (*pat==0) return *name==0;
+	if (pat[0]=='*' && pat[1]=='*') {
+		do {
+			if (globMatch(pat+2, name)) return 1;
+		} while (*name++);
+		return 0;
+	}
+	if (pat[0]=='*') {
+		do {
+			if (globMatch(pat+1, name)) return 1;
+		} while (*name!='/' && *name++);
+		return 0;
+	}
+	if (*name==0) return 0;
+	if (*pat!=*name && (*pat!='?' || *name=='/')) return 0;
+	return globMatch(pat+1, name+1);
+}
+
+//Read the manifest: every line is a glob followed by key=value settings for the files it
+//matches, see the usage. Settings of later lines override those of earlier ones.
+void readManifest(char *manifestFile) {
+	FILE *f=fopen(manifestFile, "r");
+	char line[1024];
+	char *tok, *val;
+	int lineNo=0;
+	Policy *p;
+
+	if (f==NULL) {
+		perror(manifestFile);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineNo++;
+		tok=strtok(line, " \t\r\n");
+		if (tok==NULL || tok[0]=='#') continue;
+		rules=realloc(rules, (ruleCount+1)*sizeof(Rule));
+		if (rules==NULL) {
+			perror("allocating manifest");
+			exit(1);
+		}
+		while (tok[0]=='/') tok++;
+		rules[ruleCount].pattern=strdup(tok);
+		p=&rules[ruleCount].policy;
+		ruleCount++;
+		p->compression=-1;
+		p->level=-1;
+		p->gzip=-1;
+		p->cache=NULL;
+		p->mime=NULL;
+		p->aliases=NULL;
+		p->fingerprint=-1;
+		p->minify=-1;
+		p->inlined=-1;
+		p->precache=-1;
+		while ((tok=strtok(NULL, " \t\r\n"))!=NULL) {
+			val=strchr(tok, '=');
+			if (val==NULL) val=""; else *val++=0;
+			if (strcmp(tok, "compress")==0 && strcmp(val, "none")==0) {
+				p->compression=COMPRESS_NONE;
+				p->gzip=0;
+#ifdef ESPFS_HEATSHRINK
+			} else if (strcmp(tok, "compress")==0 && strcmp(val, "heatshrink")==0) {
+				p->compression=COMPRESS_HEATSHRINK;
+				p->gzip=0;
+#endif
+			} else if (strcmp(tok, "compress")==0 && strcmp(val, "lz4")==0) {
+				p->compression=COMPRESS_LZ4;
+				p->gzip=0;
+#ifdef ESPFS_GZIP
+			} else if (strcmp(tok, "compress")==0 && strcmp(val, "gzip")==0) {
+				p->gzip=1;
+#endif
+			} else if (strcmp(tok, "level")==0 && atoi(val)>=1 && atoi(val)<=9) {
+				p->level=atoi(val);
+			} else if (strcmp(tok, "cache")==0 && strcmp(val, "immutable")==0) {
+				p->cache=CACHE_IMMUTABLE;
+			} else if (strcmp(tok, "cache")==0 && val[0]>='0' && val[0]<='9') {
+				p->cache=malloc(strlen(val)+32);
+				sprintf(p->cache, "max-age=%d, must-revalidate", atoi(val));
+			} else if (strcmp(tok, "cache")==0 && val[0]!=0) {
+				p->cache=strdup(val);
+			} else if (strcmp(tok, "mime")==0 && val[0]!=0) {
+				p->mime=strdup(val);
+			} else if (strcmp(tok, "alias")==0 && val[0]!=0) {
+				p->aliases=strdup(val);
+			} else if (strcmp(tok, "fingerprint")==0 && (strcmp(val, "yes")==0 || strcmp(val, "no")==0)) {
+				p->fingerprint=(val[0]=='y');
+			} else if (strcmp(tok, "minify")==0 && (strcmp(val, "yes")==0 || strcmp(val, "no")==0)) {
+				p->minify=(val[0]=='y');
+			} else if (strcmp(tok, "inline")==0 && (strcmp(val, "yes")==0 || strcmp(val, "no")==0)) {
+				p->inlined=(val[0]=='y');
+			} else if (strcmp(tok, "precache")==0 && (strcmp(val, "yes")==0 || strcmp(val, "no")==0)) {
+				p->precache=(val[0]=='y');
+			} else {
+				fprintf(stderr, "%s:%d: can't do %s=%s\n", manifestFile, lineNo, tok, val);
+				exit(1);
+			}
+		}
+	}
+	fclose(f);
+}
+
+//Work out the policy of the file stored as name. Patterns match the name in the html directory;
+//those without a '/' match the file name in any directory.
+void filePolicy(char *name, Policy *p) {
+	Asset *a=assetByName(name);
+	char *base;
+	Policy *r;
+	int i;
+
+	if (a!=NULL) name=sourceName(a->path);
+	base=strrchr(name, '/');
+	base=(base==NULL)?name:base+1;
+	p->compression=-1;
+	p->level=-1;
+	p->gzip=-1;
+	p->cache=NULL;
+	p->mime=NULL;
+	p->aliases=NULL;
+	p->fingerprint=-1;
+	p->minify=-1;
+	p->inlined=-1;
+	p->precache=-1;
+	for (i=0; i<ruleCount; i++) {
+		if (!globMatch(rules[i].pattern, strchr(rules[i].pattern, '/')?name:base)) continue;
+		r=&rules[i].policy;
+		if (r->compression>=0) p->compression=r->compression;
+		if (r->level>0) p->level=r->level;
+		if (r->gzip>=0) p->gzip=r->gzip;
+		if (r->cache!=NULL) p->cache=r->cache;
+		if (r->mime!=NULL) p->mime=r->mime;
+		if (r->aliases!=NULL) p->aliases=r->aliases;
+		if (r->fingerprint>=0) p->fingerprint=r->fingerprint;
+		if (r->minify>=0) p->minify=r->minify;
+		if (r->inlined>=0) p->inlined=r->inlined;
+		if (r->precache>=0) p->precache=r->precache;
+	}
+	//A fingerprinted name always has the same contents, so clients can keep it for good. What
+	//references it has to be checked every time, or it can outlive the files after an update.
+	if (a!=NULL && a->fingerprinted && p->cache==NULL) p->cache=CACHE_IMMUTABLE;
+	if (a!=NULL && a->refersFingerprinted && p->cache==NULL) p->cache="no-cache";
+	//The service worker and its manifest are how clients find out about everything else
+	if (a!=NULL && a->generated && p->cache==NULL) p->cache="no-cache";
+	//Only files of the html directory are precached
+	if (a!=NULL && a->generated) p->precache=0;
+}
+
+int sameString(char *a, char *b) {
+	return (a==NULL || b==NULL)?a==b:strcmp(a, b)==0;
+}
+
+//Whether files with these policies end up stored the same
+int samePolicy(Policy *a, Policy *b) {
+	return a->compression==b->compression && a->level==b->level && a->gzip==b->gzip &&
+			sameString(a->cache, b->cache) && sameString(a->mime, b->mime);
+}
+
+#ifdef ESPFS_GZIP
+//Whether the file stored as name is gzipped, by the manifest or else by its extension
+int gzipFile(char *name, Policy *p) {
+	return (p->gzip>=0)?p->gzip:shouldCompressGzip(name);
+}
+#endif
+
+//Append the ATTR_CACHE_CONTROL and ATTR_MIME attributes the manifest sets
+int addPolicyAttrs(char *buf, int len, Policy *p) {
+	if (p->cache!=NULL) len=addAttr(buf, len, ATTR_CACHE_CONTROL, p->cache, strlen(p->cache)+1);
+	if (p->mime!=NULL) len=addAttr(buf, len, ATTR_MIME, p->mime, strlen(p->mime)+1);
+	return len;
+}
+
+//Room addPolicyAttrs needs at most
+int policyAttrsSize(Policy *p) {
+	int len=0;
+	if (p->cache!=NULL) len+=sizeof(EspFsAttr)+strlen(p->cache)+4;
+	if (p->mime!=NULL) len+=sizeof(EspFsAttr)+strlen(p->mime)+4;
+	return len;
+}
+
+//Fingerprint every file but the html pages (-F); the manifest can say otherwise per file
+int fingerprint=0;
+
+int hasExtension(char *name, char *list) {
+	char *ext=strrchr(name, '.');
+	char *p;
+	int len;
+	if (ext==NULL || strchr(ext, '/')!=NULL) return 0;
+	ext++;
+	len=strlen(ext);
+	if (len==0) return 0;
+	for (p=list; (p=strstr(p, ext))!=NULL; p+=len) {
+		if ((p==list || p[-1]==',') && (p[len]==',' || p[len]==0)) return 1;
+	}
+	return 0;
+}
+
+//Files references to fingerprinted files are rewritten in
+#define REFERRER_EXTENSIONS "html,htm,css,js,mjs,svg"
+
+int isBlank(char c) {
+	return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f' || c=='\v';
+}
+
+int isWordChar(char c) {
+	return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c=='_' || c=='$' ||
+			(c&0x80);
+}
+
+int isPathChar(char c) {
+	return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') ||
+			(c!=0 && strchr("._~/%@+-", c)!=NULL);
+}
+
+//Resolve the reference ref (len bytes) in the file with the name name in the html directory to
+//the name of the file it points at, in path (of size bytes). Returns 0 if it doesn't point into
+//the html directory.
+int resolvePath(char *name, char *ref, int len, char *path, int size) {
+	char *dir=strrchr(name, '/');
+	int plen=0, i;
+
+	if (len<1 || (len>1 && ref[0]=='/' && ref[1]=='/')) return 0;
+	if (ref[0]=='/') {
+		ref++;
+		len--;
+	} else if (dir!=NULL) {
+		plen=dir-name+1;
+		if (plen>=size) return 0;
+		memcpy(path, name, plen);
+	}
+	//Append it a segment at a time, to take care of "." and ".."
+	while (len>0) {
+		for (i=0; i<len && ref[i]!='/'; i++) ;
+		if (i==1 && ref[0]=='.') {
+		} else if (i==2 && ref[0]=='.' && ref[1]=='.') {
+			if (plen==0) return 0;
+			for (plen--; plen>0 && path[plen-1]!='/'; plen--) ;
+		} else if (i>0) {
+			if (plen+i+1>=size) return 0;
+			memcpy(path+plen, ref, i);
+			plen+=i;
+			if (i<len) path[plen++]='/';
+		}
+		ref+=i+(i<len);
+		len-=i+(i<len);
+	}
+	path[plen]=0;
+	return 1;
+}
+
+//The fingerprinted asset the reference ref (len bytes) in the file with the name name in the
+//html directory points at, if any
+Asset *resolveRef(char *name, char *ref, int len) {
+	char path[1024];
+	int i;
+
+	if (len<2 || !resolvePath(name, ref, len, path, sizeof(path))) return NULL;
+	for (i=0; i<assetCount; i++) {
+		if (assets[i].fingerprinted && strcmp(sourceName(assets[i].path), path)==0) {
+			return &assets[i];
+		}
+	}
+	return NULL;
+}
+
+//Find the next thing in data from *i on that looks like a path in quotes or url(), and leave
+//where it starts (after the quote) in *i and where it ends in *j. Returns 0 if there is none.
+int nextRef(char *data, off_t size, off_t *i, off_t *j) {
+	while (*i<size) {
+		if (strchr("\"'`(", data[*i])==NULL || data[*i]==0) {
+			(*i)++;
+			continue;
+		}
+		for (*j=*i+1; *j<size && isPathChar(data[*j]); (*j)++) ;
+		if (*j<size && strchr("\"'`)?# ,", data[*j])!=NULL && data[*j]!=0) {
+			(*i)++;
+			return 1;
+		}
+		*i=*j;
+	}
+	return 0;
+}
+
+//Where the word word before data+i (skipping blanks) starts, or -1 if it isn't there
+off_t wordBefore(char *data, off_t i, char *word) {
+	int len=strlen(word);
+	while (i>0 && isBlank(data[i-1])) i--;
+	if (i<len || memcmp(data+i-len, word, len)!=0 || (i>len && isWordChar(data[i-len-1]))) return -1;
+	return i-len;
+}
+
+//Whether the string from data+i to data+j in a script is a module specifier, which is relative
+//to the script: import/export ... from "x", import "x", import("x") and
+//new URL("x", import.meta.url). Any other path in a script, say for fetch() or an element's
+//src, is relative to the page.
+int moduleRef(char *data, off_t size, off_t i, off_t j) {
+	char *meta=",import.meta.url)";
+	off_t k=i-1;
+	int m=0;
+
+	while (k>0 && isBlank(data[k-1])) k--;
+	if (k==0 || data[k-1]!='(') {
+		return wordBefore(data, k, "from")>=0 || wordBefore(data, k, "import")>=0;
+	}
+	k--;
+	if (wordBefore(data, k, "import")>=0) return 1;
+	k=wordBefore(data, k, "URL");
+	if (k<0 || wordBefore(data, k, "new")<0) return 0;
+	//The base may be spaced any way
+	for (k=j+1; k<size && meta[m]!=0; k++) {
+		if (!isBlank(data[k]) && data[k]!=meta[m++]) return 0;
+	}
+	return meta[m]==0;
+}
+
+//Whether the path ref (len bytes) found at data+i in the file with the name name is relative to
+//a page rather than to the file itself: a relative path in a script, other than a module.
+int pageRelative(char *name, char *data, off_t size, off_t i, off_t j) {
+	return hasExtension(name, "js,mjs") && data[i]!='/' && !moduleRef(data, size, i, j);
+}
+
+//Find the references to fingerprinted files in the data of the file stored as name: paths in
+//quotes or url(), absolute or relative to the file, and call found with each. When out is
+//given, the data is copied to it with the file names of those references replaced by the
+//names the files are stored as; out must have room for that. Returns the size of that copy.
+off_t scanRefs(char *name, char *data, off_t size, char *out, void (*found)(Asset *a, void *arg),
+		void *arg) {
+	off_t i=0, j, copied=0, outSize=0;
+	char *base, *newBase;
+	Asset *a;
+
+	while (nextRef(data, size, &i, &j)) {
+		if (pageRelative(name, data, size, i, j) || (a=resolveRef(name, data+i, j-i))==NULL) {
+			i=j;
+			continue;
+		}
+		if (found!=NULL) found(a, arg);
+		//Only the file name changes
+		for (base=data+j; base>data+i && base[-1]!='/'; base--) ;
+		newBase=strrchr(a->name, '/');
+		newBase=(newBase==NULL)?a->name:newBase+1;
+		if (out!=NULL) {
+			memcpy(out+outSize, data+copied, base-data-copied);
+			outSize+=base-data-copied;
+			memcpy(out+outSize, newBase, strlen(newBase));
+			outSize+=strlen(newBase);
+		}
+		copied=i=j;
+	}
+	if (out!=NULL) memcpy(out+outSize, data+copied, size-copied);
+	return outSize+size-copied;
+}
+
+//Room the copy scanRefs makes of size bytes may need at most: references are at least 2
+//bytes apart, and every one may get a fingerprint.
+off_t scanRefsBound(off_t size) {
+	return size+(size/2+1)*9;
+}
+
+//Scripts don't know which page they run in, so a path they use relative to it can't be
+//rewritten. Don't fingerprint any file such a path in the script name might point at, from
+//whatever directory: every one with a name ending in it.
+void keepPageRefs(char *name) {
+	char *data, *ref;
+	off_t size, i=0, j;
+	int len, k, l;
+
+	data=loadFile(name, &size);
+	if (data==NULL) {
+		perror(name);
+		exit(1);
+	}
+	while (nextRef(data, size, &i, &j)) {
+		if (pageRelative(name, data, size, i, j)) {
+			ref=data+i;
+			len=j-i;
+			while (len>=2 && ref[0]=='.' && (ref[1]=='/' || (len>=3 && ref[1]=='.' && ref[2]=='/'))) {
+				l=(ref[1]=='/')?2:3;
+				ref+=l;
+				len-=l;
+			}
+			for (k=0; len>=2 && k<assetCount; k++) {
+				char *path=sourceName(assets[k].path);
+				l=strlen(path);
+				if (!assets[k].fingerprinted || l<len || memcmp(path+l-len, ref, len)!=0 ||
+						(l>len && path[l-len-1]!='/')) continue;
+				fprintf(stderr, "%s: may be used relative to a page by %s, not fingerprinted\n",
+						path, sourceName(name));
+				assets[k].fingerprinted=0;
+			}
+		}
+		i=j;
+	}
+	unloadFile(name, data, size);
+}
+
+typedef struct {
+	int *named;
+	Asset *self;
+	int unnamed;
+	int any;
+	int *refs; //when not NULL, the unnamed assets referenced are added here
+	int refCount;
+} RefCheck;
+
+void checkRef(Asset *a, void *arg) {
+	RefCheck *c=(RefCheck *)arg;
+	c->any=1;
+	if (a!=c->self && !c->named[a-assets]) {
+		c->unnamed=1;
+		if (c->refs!=NULL) c->refs[c->refCount++]=a-assets;
+	}
+}
+
+//Name the fingerprinted asset a after the hash of its contents
+void nameAsset(Asset *a, uint64_t hash) {
+	char *base=strrchr(a->name, '/');
+	char *ext;
+	char *name=malloc(strlen(a->name)+10);
+	base=(base==NULL)?a->name:base+1;
+	ext=strrchr(base, '.');
+	if (ext==NULL || ext==base) ext=base+strlen(base);
+	sprintf(name, "%.*s.%08x%s", (int)(ext-a->name), a->name, (unsigned int)(hash^(hash>>32)), ext);
+	free(a->name);
+	a->name=name;
+}
+
+//Hash of the data of asset i with the references to named files rewritten
+uint64_t refsHash(int i, char **src, off_t *srcSize) {
+	char *tmp=malloc(scanRefsBound(srcSize[i]));
+	off_t size=scanRefs(sourceName(assets[i].path), src[i], srcSize[i], tmp, NULL, NULL);
+	uint64_t hash=hashContent(tmp, size);
+	free(tmp);
+	return hash;
+}
+
+//Of the unnamed assets, mark those that reach (or with back set, are reached from) asset i
+//through references in mark, which is cleared first.
+void reachUnnamed(int i, int back, int **refs, int *refCount, int *named, char *mark) {
+	int k, l, progress;
+	memset(mark, 0, assetCount);
+	mark[i]=1;
+	do {
+		progress=0;
+		for (k=0; k<assetCount; k++) {
+			if (named[k]) continue;
+			for (l=0; l<refCount[k]; l++) {
+				if (mark[back?k:refs[k][l]] && !mark[back?refs[k][l]:k]) {
+					mark[back?refs[k][l]:k]=1;
+					progress=1;
+				}
+			}
+		}
+	} while (progress);
+}
+
+//Rename the files to fingerprint after a hash of their contents, e.g. app.js to app.1a2b3c4d.js,
+//and rewrite the references to them. A file is only hashed once the files it references are
+//named, so a change anywhere renames everything up the chain. Files referencing each other are
+//all named after one hash of their contents together, so a change to any of them renames all.
+void fingerprintFiles(char **names, int count) {
+	Policy policy;
+	RefCheck check;
+	char **src;
+	off_t *srcSize;
+	int *owned;
+	int **refs, *refCount;
+	char *reach, *reached;
+	uint64_t *hashes;
+	char *tmp;
+	off_t size;
+	int i, k, l, n, progress, candidates=0;
+	Asset *a;
+
+	for (i=0; i<count; i++) {
+		if (!isFile(names[i])) continue;
+		filePolicy(storedName(names[i]), &policy);
+		if ((policy.fingerprint<0)?(fingerprint && !hasExtension(names[i], "html,htm")):
+				policy.fingerprint) {
+			addAsset(names[i])->fingerprinted=1;
+			candidates++;
+		}
+	}
+	if (candidates==0) return;
+	for (i=0; i<count; i++) {
+		if (isFile(names[i]) && hasExtension(names[i], "js,mjs")) keepPageRefs(names[i]);
+	}
+	for (i=0; i<count; i++) {
+		if (!isFile(names[i])) continue;
+		if (hasExtension(names[i], REFERRER_EXTENSIONS)) addAsset(names[i]);
+	}
+
+	//Start from what earlier stages made of the files, taking that over
+	src=calloc(assetCount, sizeof(char *));
+	srcSize=calloc(assetCount, sizeof(off_t));
+	owned=calloc(assetCount, sizeof(int));
+	check.named=calloc(assetCount, sizeof(int));
+	check.refs=NULL;
+	refs=calloc(assetCount, sizeof(int *));
+	refCount=calloc(assetCount, sizeof(int));
+	reach=calloc(assetCount, 1);
+	reached=calloc(assetCount, 1);
+	for (i=0; i<assetCount; i++) {
+		a=&assets[i];
+		owned[i]=(a->data!=NULL);
+		src[i]=loadFile(a->path, &srcSize[i]);
+		if (src[i]==NULL) {
+			perror(a->path);
+			exit(1);
+		}
+		a->data=NULL;
+	}
+
+	//Name the files whose references are all named, until only cycles (and the files
+	//referencing them) are left
+	do {
+		progress=0;
+		for (i=0; i<assetCount; i++) {
+			a=&assets[i];
+			if (!a->fingerprinted || check.named[i]) continue;
+			check.self=a;
+			check.unnamed=0;
+			check.any=0;
+			if (hasExtension(a->path, REFERRER_EXTENSIONS)) {
+				scanRefs(sourceName(a->path), src[i], srcSize[i], NULL, checkRef, &check);
+			}
+			if (check.unnamed) continue;
+			if (check.any) {
+				nameAsset(a, refsHash(i, src, srcSize));
+			} else {
+				nameAsset(a, hashContent(src[i], srcSize[i]));
+			}
+			check.named[i]=1;
+			progress=1;
+		}
+		if (progress) continue;
+
+		//Find a cycle that only references named files outside of it, going down the
+		//references of the first file left, and name all of it together
+		for (i=0; i<assetCount; i++) {
+			free(refs[i]);
+			refs[i]=NULL;
+			refCount[i]=0;
+			if (!assets[i].fingerprinted || check.named[i]) continue;
+			check.self=&assets[i];
+			check.refs=refs[i]=malloc((srcSize[i]/2+1)*sizeof(int));
+			check.refCount=0;
+			scanRefs(sourceName(assets[i].path), src[i], srcSize[i], NULL, checkRef, &check);
+			refCount[i]=check.refCount;
+		}
+		check.refs=NULL;
+		for (i=0; i<assetCount && (!assets[i].fingerprinted || check.named[i]); i++) ;
+		while (i<assetCount) {
+			reachUnnamed(i, 0, refs, refCount, check.named, reach);
+			reachUnnamed(i, 1, refs, refCount, check.named, reached);
+			for (k=0; k<assetCount; k++) reach[k]&=reached[k];
+			//A reference out of the cycle leads further down
+			for (k=0, l=-1; k<assetCount && l<0; k++) {
+				for (n=0; reach[k] && n<refCount[k] && l<0; n++) {
+					if (!reach[refs[k][n]]) l=refs[k][n];
+				}
+			}
+			if (l<0) break;
+			i=l;
+		}
+		if (i<assetCount) {
+			hashes=malloc(assetCount*sizeof(uint64_t));
+			for (k=0, n=0; k<assetCount; k++) {
+				if (reach[k]) hashes[n++]=refsHash(k, src, srcSize);
+			}
+			for (k=0; k<assetCount; k++) {
+				if (!reach[k]) continue;
+				nameAsset(&assets[k], hashContent((char *)hashes, n*sizeof(uint64_t)));
+				check.named[k]=1;
+			}
+			free(hashes);
+			progress=1;
+		}
+	} while (progress);
+	for (i=0; i<assetCount; i++) free(refs[i]);
+	free(refs);
+	free(refCount);
+	free(reach);
+	free(reached);
+
+	//Now that every name is known, rewrite all references
+	for (i=0; i<assetCount; i++) {
+		a=&assets[i];
+		check.self=a;
+		check.any=0;
+		tmp=NULL;
+		if (hasExtension(a->path, REFERRER_EXTENSIONS)) {
+			tmp=malloc(scanRefsBound(srcSize[i]));
+			size=scanRefs(sourceName(a->path), src[i], srcSize[i], tmp, checkRef, &check);
+		}
+		if (check.any) {
+			a->data=tmp;
+			a->size=size;
+			if (owned[i]) free(src[i]); else unmapFile(src[i], srcSize[i]);
+		} else {
+			free(tmp);
+			if (owned[i]) {
+				a->data=src[i];
+				a->size=srcSize[i];
+			} else {
+				unmapFile(src[i], srcSize[i]);
+			}
+		}
+		a->refersFingerprinted=check.any && !a->fingerprinted;
+		if (a->fingerprinted) fprintf(stderr, "%s -> %s\n", sourceName(a->path), a->name);
+	}
+	free(src);
+	free(srcSize);
+	free(owned);
+	free(check.named);
+}
+
+//Response headers are only prebaked into the image when asked for
+int prebakeHeaders=0;
+
+char *mimeType(char *name) {
+	char *ext=strrchr(name, '.');
+	int i;
+	if (ext!=NULL && strchr(ext, '/')==NULL) {
+		for (i=0; i<sizeof(espFsMimeTypes)/sizeof(*espFsMimeTypes); i++) {
+			if (strcasecmp(espFsMimeTypes[i].ext, ext+1)==0) return (char *)espFsMimeTypes[i].mime;
+		}
+	}
+	return "application/octet-stream";
+}
+
+//Minify html, css, js, svg and json files (-M); the manifest can say otherwise per file
+int minify=0;
+
+//Inline files of up to this many bytes into the pages and stylesheets referencing them (-I)
+int inlineSize=0;
+
+//Offset of the first occurrence of str in the size bytes at data, ignoring case, or -1
+off_t findCase(char *data, off_t size, char *str) {
+	off_t i, len=strlen(str);
+	for (i=0; i+len<=size; i++) {
+		if (strncasecmp(data+i, str, len)==0) return i;
+	}
+	return -1;
+}
+
+//Copy the string starting with the quote at in[i] to out+*o, up to and including the closing
+//quote. Returns the index after it, or -1 if it isn't closed (on the same line, unless
+//multiline).
+off_t copyString(char *in, off_t i, off_t size, char *out, off_t *o, int multiline) {
+	char q=in[i];
+	out[(*o)++]=in[i++];
+	while (i<size) {
+		if (in[i]=='\\' && i+1<size) {
+			out[(*o)++]=in[i++];
+			if (in[i]=='\r' && i+1<size && in[i+1]=='\n') out[(*o)++]=in[i++];
+		} else if (in[i]==q) {
+			out[(*o)++]=in[i++];
+			return i;
+		} else if (!multiline && (in[i]=='\n' || in[i]=='\r')) {
+			return -1;
+		}
+		out[(*o)++]=in[i++];
+	}
+	return -1;
+}
+
+//Whether a '/' following the javascript in out (o bytes) starts a regular expression rather
+//than being a division: it does where an operand is expected.
+int startsRegex(char *out, off_t o) {
+	static char *keywords[]={"return", "typeof", "instanceof", "in", "of", "new", "delete",
+			"void", "throw", "case", "do", "else", "yield", "await", NULL};
+	off_t end;
+	int i;
+
+	while (o>0 && isBlank(out[o-1])) o--;
+	if (o==0 || strchr("(,=:[!&|?{};+-*%<>~^", out[o-1])!=NULL) return 1;
+	if (!isWordChar(out[o-1])) return 0;
+	for (end=o; o>0 && isWordChar(out[o-1]); o--) ;
+	for (i=0; keywords[i]!=NULL; i++) {
+		if (end-o==strlen(keywords[i]) && memcmp(out+o, keywords[i], end-o)==0) return 1;
+	}
+	return 0;
+}
+
+//Copy the javascript regular expression starting at in[i] like copyString
+off_t copyRegex(char *in, off_t i, off_t size, char *out, off_t *o) {
+	int inClass=0;
+	out[(*o)++]=in[i++];
+	while (i<size && (in[i]!='/' || inClass)) {
+		if (in[i]=='\n' || in[i]=='\r') return -1;
+		if (in[i]=='[') inClass=1;
+		if (in[i]==']') inClass=0;
+		if (in[i]=='\\' && i+1<size) out[(*o)++]=in[i++];
+		out[(*o)++]=in[i++];
+	}
+	if (i>=size) return -1;
+	out[(*o)++]=in[i++];
+	return i;
+}
+
+//Copy the javascript template literal starting at in[i] like copyString, along with the strings,
+//templates, regular expressions and comments in its substitutions.
+off_t copyTemplate(char *in, off_t i, off_t size, char *out, off_t *o) {
+	off_t j;
+	char *end;
+	int depth;
+	out[(*o)++]=in[i++];
+	while (i<size) {
+		if (in[i]=='\\' && i+1<size) {
+			out[(*o)++]=in[i++];
+		} else if (in[i]=='`') {
+			out[(*o)++]=in[i++];
+			return i;
+		} else if (in[i]=='$' && i+1<size && in[i+1]=='{') {
+			out[(*o)++]=in[i++];
+			for (depth=0; i<size; ) {
+				if (in[i]=='"' || in[i]=='\'') {
+					i=copyString(in, i, size, out, o, 0);
+				} else if (in[i]=='`') {
+					i=copyTemplate(in, i, size, out, o);
+				} else if (in[i]=='/' && i+1<size && (in[i+1]=='*' || in[i+1]=='/')) {
+					//Comments go along, to not take their insides for code
+					end=(in[i+1]=='*')?"*/":"\n";
+					j=findCase(in+i+2, size-i-2, end);
+					if (j<0) return -1;
+					j+=i+2+strlen(end);
+					memcpy(out+*o, in+i, j-i);
+					*o+=j-i;
+					i=j;
+					continue;
+				} else if (in[i]=='/' && startsRegex(out, *o)) {
+					i=copyRegex(in, i, size, out, o);
+				} else {
+					if (in[i]=='{') depth++;
+					if (in[i]=='}' && --depth==0) break;
+					out[(*o)++]=in[i++];
+					continue;
+				}
+				if (i<0) return -1;
+			}
+			if (i>=size) return -1;
+		}
+		out[(*o)++]=in[i++];
+	}
+	return -1;
+}
+
+//Minify javascript: drop comments (but /*! ones) and whitespace, keeping a line break wherever
+//a statement may end at it. Strings, templates and regular expressions (told from divisions by
+//what precedes them, or where that can't be told, the rest of the line) are copied as they are. Returns the size of the result in out, which needs
+//room for size bytes, or -1 if the code doesn't scan, in which case it's best left alone.
+off_t minifyJs(char *in, off_t size, char *out) {
+	off_t i=0, o=0, j;
+	int space=0;
+	char c, prev;
+
+	while (i<size) {
+		c=in[i];
+		if (isBlank(c)) {
+			if (c=='\n' || c=='\r') space=2; else if (space==0) space=1;
+			i++;
+			continue;
+		}
+		if (c=='/' && i+1<size && in[i+1]=='/') {
+			while (i<size && in[i]!='\n' && in[i]!='\r') i++;
+			continue;
+		}
+		if (c=='/' && i+1<size && in[i+1]=='*') {
+			for (j=i+2; j+1<size && !(in[j]=='*' && in[j+1]=='/'); j++) {
+				if (in[j]=='\n') space=2;
+			}
+			if (j+1>=size) return -1;
+			if (in[i+2]=='!') {
+				if (o>0) out[o++]='\n';
+				memcpy(out+o, in+i, j+2-i);
+				o+=j+2-i;
+				space=2;
+			} else if (space==0) {
+				space=1;
+			}
+			i=j+2;
+			continue;
+		}
+		//Whitespace only stays where it separates tokens, or may end a statement
+		prev=(o>0)?out[o-1]:0;
+		if (space==2 && o>0 && strchr("{;,(", prev)==NULL && strchr("});,]", c)==NULL) {
+			out[o++]='\n';
+		} else if (space==1 && o>0 && ((strchr("{}()[];,=:<>?!&|*%^~+-", prev)==NULL &&
+				strchr("{}()[];,=:<>?!&|*%^~+-", c)==NULL) ||
+				(prev==c && (c=='+' || c=='-')) || (prev=='<' && c=='!'))) {
+			out[o++]=' ';
+		}
+		space=0;
+		if (c=='"' || c=='\'') {
+			i=copyString(in, i, size, out, &o, 0);
+			if (i<0) return -1;
+		} else if (c=='`') {
+			i=copyTemplate(in, i, size, out, &o);
+			if (i<0) return -1;
+		} else if (c=='/' && (prev==')' || prev=='}')) {
+			//That may be a division as well as a regular expression, as in if (a) /x/.test(s),
+			//so the rest of the line goes as it is. A template or string running on past it
+			//would be taken for code on the next line.
+			for (j=i; j<size && in[j]!='\n' && in[j]!='\r'; j++) {
+				if (in[j]=='`') return -1;
+			}
+			if (in[j-1]=='\\') return -1;
+			memcpy(out+o, in+i, j-i);
+			o+=j-i;
+			i=j;
+		} else if (c=='/' && startsRegex(out, o)) {
+			i=copyRegex(in, i, size, out, &o);
+			if (i<0) return -1;
+		} else {
+			out[o++]=in[i++];
+		}
+	}
+	return o;
+}
+
+//Minify css: drop comments (but /*! ones), the whitespace next to punctuation and the last ';'
+//of a block. Strings and unquoted url()s are copied as they are. Returns the size like minifyJs.
+off_t minifyCss(char *in, off_t size, char *out) {
+	off_t i=0, o=0, j;
+	int space=0;
+	char c;
+
+	while (i<size) {
+		c=in[i];
+		if (isBlank(c)) {
+			space=1;
+			i++;
+			continue;
+		}
+		if (c=='/' && i+1<size && in[i+1]=='*') {
+			for (j=i+2; j+1<size && !(in[j]=='*' && in[j+1]=='/'); j++) ;
+			if (j+1>=size) return -1;
+			if (in[i+2]=='!') {
+				memcpy(out+o, in+i, j+2-i);
+				o+=j+2-i;
+			}
+			space=1;
+			i=j+2;
+			continue;
+		}
+		//Not before a ':', that's a descendant's pseudo-class
+		if (space && o>0 && strchr("{};,>:(", out[o-1])==NULL && strchr("{};,>)!", c)==NULL) {
+			out[o++]=' ';
+		}
+		space=0;
+		if (c=='}' && o>0 && out[o-1]==';') o--;
+		if (c=='"' || c=='\'') {
+			i=copyString(in, i, size, out, &o, 0);
+			if (i<0) return -1;
+		} else if (c=='(' && o>=3 && strncasecmp(out+o-3, "url", 3)==0) {
+			for (j=i+1; j<size && isBlank(in[j]); j++) ;
+			if (j<size && in[j]!='"' && in[j]!='\'') {
+				while (j<size && in[j]!=')') j++;
+				if (j>=size) return -1;
+			} else {
+				j=i+1;
+			}
+			memcpy(out+o, in+i, j-i);
+			o+=j-i;
+			i=j;
+		} else {
+			out[o++]=in[i++];
+		}
+	}
+	return o;
+}
+
+//Minify json: drop all whitespace outside strings. Returns the size like minifyJs.
+off_t minifyJson(char *in, off_t size, char *out) {
+	off_t i=0, o=0;
+	while (i<size) {
+		if (in[i]=='"') {
+			i=copyString(in, i, size, out, &o, 0);
+			if (i<0) return -1;
+		} else if (isBlank(in[i])) {
+			i++;
+		} else {
+			out[o++]=in[i++];
+		}
+	}
+	return o;
+}
+
+//Find the attribute attr in the tag (len bytes, from '<' on). Returns the length of its value
+//and points val at it (past the quote, if any), or returns -1 if the tag doesn't have it.
+int tagAttr(char *tag, int len, char *attr, char **val) {
+	int i=1, name, nameLen, vlen;
+	char q;
+
+	while (i<len && !isBlank(tag[i]) && tag[i]!='>' && tag[i]!='/') i++;
+	while (i<len && tag[i]!='>') {
+		for (name=i; i<len && !isBlank(tag[i]) && tag[i]!='=' && tag[i]!='>' && tag[i]!='/'; i++) ;
+		nameLen=i-name;
+		if (nameLen==0) {
+			i++;
+			continue;
+		}
+		while (i<len && isBlank(tag[i])) i++;
+		*val=tag+i;
+		vlen=0;
+		if (i<len && tag[i]=='=') {
+			for (i++; i<len && isBlank(tag[i]); i++) ;
+			if (i<len && (tag[i]=='"' || tag[i]=='\'')) {
+				q=tag[i++];
+				for (*val=tag+i; i<len && tag[i]!=q; i++) ;
+				vlen=tag+i-*val;
+				i++;
+			} else {
+				for (*val=tag+i; i<len && !isBlank(tag[i]) && tag[i]!='>'; i++) ;
+				vlen=tag+i-*val;
+			}
+		}
+		if (nameLen==strlen(attr) && strncasecmp(tag+name, attr, nameLen)==0) return vlen;
+	}
+	return -1;
+}
+
+//Whether the value of the attribute attr of the tag is one of the comma separated values in list
+//(ignoring case); absent is a value of "".
+int tagAttrIs(char *tag, int len, char *attr, char *list) {
+	char *val, *end;
+	int vlen=tagAttr(tag, len, attr, &val);
+	if (vlen<0) vlen=0;
+	while (1) {
+		end=strchr(list, ',');
+		if (end==NULL) end=list+strlen(list);
+		if (end-list==vlen && strncasecmp(list, val, vlen)==0) return 1;
+		if (*end==0) return 0;
+		list=end+1;
+	}
+}
+
+//The name of the tag (len bytes, from '<' on) is name
+int tagIs(char *tag, int len, char *name) {
+	int nameLen=strlen(name);
+	return len>nameLen+1 && strncasecmp(tag+1, name, nameLen)==0 &&
+			(isBlank(tag[nameLen+1]) || tag[nameLen+1]=='>' || tag[nameLen+1]=='/');
+}
+
+#define JS_TYPES ",text/javascript,application/javascript"
+
+//Minify html or svg markup: drop comments and collapse every run of whitespace to a single space,
+//or a line break if it has one, which is all browsers make of it anyway. The contents of pre,
+//textarea, script and style elements and CDATA sections are left alone, except that the scripts
+//and styles of a page are minified as such. Returns the size like minifyJs.
+off_t minifyMarkup(char *in, off_t size, char *out, int html) {
+	off_t i=0, o=0, j, tag, n;
+	int space=0;
+	char c, *end;
+
+	while (i<size) {
+		c=in[i];
+		if (isBlank(c)) {
+			if (c=='\n' || c=='\r') space=2; else if (space==0) space=1;
+			i++;
+			continue;
+		}
+		if (c=='<' && i+3<size && memcmp(in+i, "<!--", 4)==0) {
+			j=findCase(in+i+4, size-i-4, "-->");
+			if (j<0) return -1;
+			j+=i+7;
+			//Keep the conditional comments of old IE
+			if (html && j-i>9 && memcmp(in+i+4, "[if", 3)==0) {
+				if (space && o>0) out[o++]=(space==2)?'\n':' ';
+				space=0;
+				memcpy(out+o, in+i, j-i);
+				o+=j-i;
+			}
+			i=j;
+			continue;
+		}
+		if (space && o>0) out[o++]=(space==2)?'\n':' ';
+		space=0;
+		if (c=='<' && i+8<size && memcmp(in+i, "<![CDATA[", 9)==0) {
+			j=findCase(in+i+9, size-i-9, "]]>");
+			if (j<0) return -1;
+			j+=i+12;
+			memcpy(out+o, in+i, j-i);
+			o+=j-i;
+			i=j;
+			continue;
+		}
+		if (c!='<' || i+1>=size || !((in[i+1]>='a' && in[i+1]<='z') ||
+				(in[i+1]>='A' && in[i+1]<='Z') || strchr("/!?", in[i+1])!=NULL)) {
+			out[o++]=in[i++];
+			continue;
+		}
+		//A tag: attribute values stay as they are
+		tag=o;
+		while (i<size && in[i]!='>') {
+			if (in[i]=='"' || in[i]=='\'') {
+				i=copyString(in, i, size, out, &o, 1);
+				if (i<0) return -1;
+			} else if (isBlank(in[i])) {
+				while (i<size && isBlank(in[i])) i++;
+				if (i<size && in[i]!='>' && in[i]!='=' && out[o-1]!='=') out[o++]=' ';
+			} else {
+				out[o++]=in[i++];
+			}
+		}
+		if (i>=size) return -1;
+		out[o++]=in[i++];
+		if (!html || out[o-2]=='/') continue;
+		end=NULL;
+		if (tagIs(out+tag, o-tag, "pre")) end="</pre";
+		if (tagIs(out+tag, o-tag, "textarea")) end="</textarea";
+		if (tagIs(out+tag, o-tag, "script")) end="</script";
+		if (tagIs(out+tag, o-tag, "style")) end="</style";
+		if (end==NULL) continue;
+		j=findCase(in+i, size-i, end);
+		if (j<0) return -1;
+		n=-1;
+		if (strcmp(end, "</style")==0) {
+			n=minifyCss(in+i, j, out+o);
+		} else if (strcmp(end, "</script")==0 &&
+				tagAttrIs(out+tag, o-tag, "type", JS_TYPES ",module")) {
+			n=minifyJs(in+i, j, out+o);
+		}
+		if (n<0) {
+			memcpy(out+o, in+i, j);
+			n=j;
+		}
+		o+=n;
+		i+=j;
+	}
+	return o;
+}
+
+//Minify the html, css, js, svg and json files (-M, or as the manifest says), taking out the
+//comments and whitespace that don't change what the files do.
+void minifyFiles(char **names, int count) {
+	Policy policy;
+	char *data, *out;
+	off_t size, n;
+	long saved=0;
+	int i, minified=0;
+	Asset *a;
+
+	for (i=0; i<count; i++) {
+		if (!isFile(names[i])) continue;
+		filePolicy(storedName(names[i]), &policy);
+		if (!((policy.minify<0)?minify:policy.minify) ||
+				!hasExtension(names[i], "html,htm,css,js,mjs,svg,json")) continue;
+		data=loadFile(names[i], &size);
+		if (data==NULL) {
+			perror(names[i]);
+			exit(1);
+		}
+		out=malloc(size+1);
+		if (hasExtension(names[i], "html,htm")) {
+			n=minifyMarkup(data, size, out, 1);
+		} else if (hasExtension(names[i], "svg")) {
+			n=minifyMarkup(data, size, out, 0);
+		} else if (hasExtension(names[i], "css")) {
+			n=minifyCss(data, size, out);
+		} else if (hasExtension(names[i], "json")) {
+			n=minifyJson(data, size, out);
+		} else {
+			n=minifyJs(data, size, out);
+		}
+		if (n<0 || n==size) {
+			if (n<0) fprintf(stderr, "%s: can't make sense of it, not minified\n", sourceName(names[i]));
+			free(out);
+			unloadFile(names[i], data, size);
+			continue;
+		}
+		a=addAsset(names[i]);
+		if (a->data==data) free(data); else unmapFile(data, size);
+		a->data=out;
+		a->size=n;
+		saved+=size-n;
+		minified++;
+	}
+	if (minified>0) fprintf(stderr, "Minified %d files, %ld bytes less\n", minified, saved);
+}
+
+//Output of a stage, growing as needed
+typedef struct {
+	char *data;
+	off_t len;
+	off_t size;
+} Buf;
+
+void bufAdd(Buf *b, const char *data, off_t len) {
+	if (len==0) return;
+	if (b->len+len>b->size) {
+		b->size=(b->len+len)*2+256;
+		b->data=realloc(b->data, b->size);
+		if (b->data==NULL) {
+			perror("allocating buffer");
+			exit(1);
+		}
+	}
+	memcpy(b->data+b->len, data, len);
+	b->len+=len;
+}
+
+//Append the data: URI of the file stored as name with the size bytes of data
+void bufAddDataUri(Buf *b, char *name, char *data, off_t size) {
+	static const char digits[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char *in=(unsigned char *)data;
+	char quad[4];
+	uint32_t v;
+	off_t i;
+
+	bufAdd(b, "data:", 5);
+	bufAdd(b, mimeType(name), strlen(mimeType(name)));
+	bufAdd(b, ";base64,", 8);
+	for (i=0; i<size; i+=3) {
+		v=in[i]<<16 | ((i+1<size)?in[i+1]<<8:0) | ((i+2<size)?in[i+2]:0);
+		quad[0]=digits[v>>18];
+		quad[1]=digits[(v>>12)&63];
+		quad[2]=(i+1<size)?digits[(v>>6)&63]:'=';
+		quad[3]=(i+2<size)?digits[v&63]:'=';
+		bufAdd(b, quad, 4);
+	}
+}
+
+//Files of these types can be inlined as data: URIs
+#define DATA_URI_EXTENSIONS "png,jpg,jpeg,svg"
+
+//Load the file the reference ref (len bytes) in the file with the name name in the html directory
+//points at, if it is in the list, of a type in exts, small enough to be inlined and the manifest
+//doesn't say otherwise. Returns its contents (to unloadFile) and list entry, or NULL.
+char *loadInlined(char **names, int count, char *name, char *ref, int len, char *exts,
+		char **path, off_t *size) {
+	char target[1024];
+	Policy policy;
+	char *data;
+	int i;
+
+	if (!resolvePath(name, ref, len, target, sizeof(target))) return NULL;
+	for (i=0; i<count; i++) {
+		if (strcmp(sourceName(names[i]), target)==0) break;
+	}
+	if (i==count || !hasExtension(target, exts) || !isFile(names[i])) return NULL;
+	filePolicy(storedName(names[i]), &policy);
+	if (policy.inlined==0) return NULL;
+	data=loadFile(names[i], size);
+	if (data!=NULL && *size>inlineSize) {
+		unloadFile(names[i], data, *size);
+		return NULL;
+	}
+	*path=names[i];
+	return data;
+}
+
+//A reference that can point at a file of the html directory: no scheme, query or fragment
+int isLocalRef(char *ref, int len) {
+	int i;
+	for (i=0; i<len; i++) {
+		if (strchr(":?#", ref[i])!=NULL || isBlank(ref[i])) return 0;
+	}
+	return len>0;
+}
+
+int sameDir(char *a, char *b) {
+	char *dirA=strrchr(a, '/'), *dirB=strrchr(b, '/');
+	int lenA=(dirA==NULL)?0:dirA-a;
+	int lenB=(dirB==NULL)?0:dirB-b;
+	return lenA==lenB && strncmp(a, b, lenA)==0;
+}
+
+//Whether the file with the name name in the html directory refers to a file in the list by a path
+//relative to it, in quotes or url() like scanRefs finds them. Inlined into a page in another
+//directory, that path would point somewhere else.
+int refersRelative(char **names, int count, char *name, char *data, off_t size) {
+	char path[1024];
+	off_t i, j;
+	int k;
+
+	for (i=0; i+1<size; i=j) {
+		for (j=i+1; j<size && isPathChar(data[j]); j++) ;
+		if (strchr("\"'`(", data[i])==NULL || data[i]==0 || data[i+1]=='/' || j==size ||
+				strchr("\"'`)?# ,", data[j])==NULL || data[j]==0 ||
+				!resolvePath(name, data+i+1, j-i-1, path, sizeof(path))) continue;
+		for (k=0; k<count; k++) {
+			if (strcmp(sourceName(names[k]), path)==0) return 1;
+		}
+	}
+	return 0;
+}
+
+//Copy the size bytes of the stylesheet stored as name to b, with the url()s of small images
+//replaced by data: URIs. Returns the number replaced.
+int inlineCss(Buf *b, char **names, int count, char *name, char *data, off_t size) {
+	off_t i=0, j, start, end;
+	off_t fileSize;
+	char *path, *file;
+	int inlined=0;
+
+	while ((j=findCase(data+i, size-i, "url("))>=0) {
+		start=i+j+4;
+		while (start<size && isBlank(data[start])) start++;
+		if (start<size && (data[start]=='"' || data[start]=='\'')) start++;
+		for (end=start; end<size && !isBlank(data[end]) && strchr("\"')", data[end])==NULL; end++) ;
+		file=NULL;
+		if (isLocalRef(data+start, end-start)) {
+			file=loadInlined(names, count, name, data+start, end-start, DATA_URI_EXTENSIONS,
+					&path, &fileSize);
+		}
+		if (file==NULL) {
+			bufAdd(b, data+i, end-i);
+			i=end;
+			continue;
+		}
+		//The quotes, if any, stay
+		bufAdd(b, data+i, start-i);
+		bufAddDataUri(b, path, file, fileSize);
+		unloadFile(path, file, fileSize);
+		i=end;
+		inlined++;
+	}
+	bufAdd(b, data+i, size-i);
+	return inlined;
+}
+
+//Copy the size bytes of the page stored as name to b, with the small stylesheets and classic
+//scripts it links to inlined as style and script elements, and small images and icons as data:
+//URIs. Stylesheets and scripts of another directory are only inlined if they don't refer to files
+//relative to it. Returns the number of files inlined.
+int inlinePage(Buf *b, char **names, int count, char *name, char *data, off_t size) {
+	off_t i=0, j, tag, tagLen, end;
+	off_t fileSize;
+	char *path, *file, *ref, *attr;
+	int refLen, inlined=0;
+
+	while (i<size) {
+		if (data[i]!='<') {
+			bufAdd(b, data+i, 1);
+			i++;
+			continue;
+		}
+		tag=i;
+		if (size-i>=4 && memcmp(data+i, "<!--", 4)==0) {
+			j=findCase(data+i, size-i, "-->");
+			end=(j<0)?size:i+j+3;
+			bufAdd(b, data+i, end-i);
+			i=end;
+			continue;
+		}
+		for (end=i; end<size && data[end]!='>'; end++) {
+			if (data[end]=='"' || data[end]=='\'') {
+				for (j=end+1; j<size && data[j]!=data[end]; j++) ;
+				end=j;
+			}
+		}
+		if (end>=size) break;
+		tagLen=end+1-tag;
+		file=NULL;
+		//Scripts and styles keep what looks like tags inside them
+		if (tagIs(data+tag, tagLen, "script") || tagIs(data+tag, tagLen, "style")) {
+			j=findCase(data+tag+tagLen, size-tag-tagLen,
+					tagIs(data+tag, tagLen, "script")?"</script":"</style");
+			end=(j<0)?size:tag+tagLen+j;
+			refLen=tagAttr(data+tag, tagLen, "src", &ref);
+			if (refLen>0 && isLocalRef(ref, refLen) &&
+					tagAttrIs(data+tag, tagLen, "type", JS_TYPES) &&
+					tagAttr(data+tag, tagLen, "async", &attr)<0 &&
+					tagAttr(data+tag, tagLen, "defer", &attr)<0 &&
+					tagAttr(data+tag, tagLen, "nomodule", &attr)<0) {
+				for (j=tag+tagLen; j<end && isBlank(data[j]); j++) ;
+				if (j==end && end<size) {
+					file=loadInlined(names, count, name, ref, refLen, "js", &path, &fileSize);
+				}
+				if (file!=NULL && (findCase(file, fileSize, "</script")>=0 ||
+						findCase(file, fileSize, "<!--")>=0 || (!sameDir(name, sourceName(path)) &&
+						refersRelative(names, count, sourceName(path), file, fileSize)))) {
+					unloadFile(path, file, fileSize);
+					file=NULL;
+				}
+			}
+			if (file==NULL) {
+				bufAdd(b, data+tag, end-tag);
+			} else {
+				bufAdd(b, "<script>", 8);
+				bufAdd(b, file, fileSize);
+				unloadFile(path, file, fileSize);
+				inlined++;
+			}
+			i=end;
+			continue;
+		}
+		if (tagIs(data+tag, tagLen, "link") && tagAttrIs(data+tag, tagLen, "rel", "stylesheet") &&
+				tagAttrIs(data+tag, tagLen, "media", ",all,screen")) {
+			refLen=tagAttr(data+tag, tagLen, "href", &ref);
+			if (refLen>0 && isLocalRef(ref, refLen)) {
+				file=loadInlined(names, count, name, ref, refLen, "css", &path, &fileSize);
+			}
+			if (file!=NULL && (findCase(file, fileSize, "</style")>=0 || (!sameDir(name,
+					sourceName(path)) && refersRelative(names, count, sourceName(path), file,
+					fileSize)))) {
+				unloadFile(path, file, fileSize);
+				file=NULL;
+			}
+			if (file!=NULL) {
+				bufAdd(b, "<style>", 7);
+				bufAdd(b, file, fileSize);
+				bufAdd(b, "</style>", 8);
+			}
+		} else if (tagIs(data+tag, tagLen, "img") || tagIs(data+tag, tagLen, "link")) {
+			refLen=tagAttr(data+tag, tagLen, tagIs(data+tag, tagLen, "img")?"src":"href", &ref);
+			if (refLen>0 && isLocalRef(ref, refLen) && (tagIs(data+tag, tagLen, "img") ||
+					tagAttrIs(data+tag, tagLen, "rel", "icon,shortcut icon,apple-touch-icon"))) {
+				file=loadInlined(names, count, name, ref, refLen, DATA_URI_EXTENSIONS, &path,
+						&fileSize);
+			}
+			if (file!=NULL) {
+				bufAdd(b, data+tag, ref-data-tag);
+				if (ref[-1]!='"' && ref[-1]!='\'') bufAdd(b, "\"", 1);
+				bufAddDataUri(b, path, file, fileSize);
+				if (ref[-1]!='"' && ref[-1]!='\'') bufAdd(b, "\"", 1);
+				bufAdd(b, ref+refLen, data+end+1-ref-refLen);
+			}
+		}
+		if (file==NULL) {
+			bufAdd(b, data+tag, tagLen);
+		} else {
+			unloadFile(path, file, fileSize);
+			inlined++;
+		}
+		i=end+1;
+	}
+	bufAdd(b, data+i, size-i);
+	return inlined;
+}
+
+//Inline the files of up to inlineSize bytes the html pages and stylesheets reference, saving the
+//requests for them: stylesheets and scripts into the pages, images as data: URIs. Stylesheets go
+//first, so they are inlined with their images. The files themselves stay in the image for
+//whatever else refers to them.
+void inlineFiles(char **names, int count) {
+	char *data;
+	off_t size;
+	int i, pass, inlined;
+	Buf b;
+	Asset *a;
+
+	for (pass=0; pass<2; pass++) {
+		for (i=0; i<count; i++) {
+			if (!isFile(names[i]) || !hasExtension(names[i], pass?"html,htm":"css")) continue;
+			data=loadFile(names[i], &size);
+			if (data==NULL) {
+				perror(names[i]);
+				exit(1);
+			}
+			b.data=NULL;
+			b.len=0;
+			b.size=0;
+			if (pass) {
+				inlined=inlinePage(&b, names, count, sourceName(names[i]), data, size);
+			} else {
+				inlined=inlineCss(&b, names, count, sourceName(names[i]), data, size);
+			}
+			if (inlined==0) {
+				free(b.data);
+				unloadFile(names[i], data, size);
+				continue;
+			}
+			a=addAsset(names[i]);
+			if (a->data==data) free(data); else unmapFile(data, size);
+			a->data=b.data;
+			a->size=b.len;
+			fprintf(stderr, "%s: inlined %d files\n", sourceName(names[i]), inlined);
+		}
+	}
+}
+
+//Name the service worker is stored under (-W), NULL for none
+char *serviceWorker=NULL;
+
+//The service worker. On install it fetches the precache manifest of its version and fills a cache
+//with the files listed there: those with the same hash come from the cache of the version before,
+//only the others are fetched, checking their ETags. It then serves them from that cache, so a
+//page load only costs the browser's check of the service worker itself. Paths that aren't in the
+//image go to the server, which may have other routes for them; the single page app fallback
+//only stands in for them when it can't be reached. The placeholders are the
+//version, the manifest and the root of the image, relative to the service worker.
+char *serviceWorkerScript=
+	"//Generated by mkespfsimage\n"
+	"const VERSION=\"%s\";\n"
+	"const MANIFEST=\"%s\";\n"
+	"const ROOT=new URL(\"%s\",location).href;\n"
+	"const CACHE=\"espfs-\"+VERSION;\n"
+	"const key=(path,hash)=>ROOT+encodeURI(path)+\"?\"+hash;\n"
+	"let manifest=null;\n"
+	"\n"
+	"self.addEventListener(\"install\",e=>e.waitUntil((async()=>{\n"
+	"\tconst res=await fetch(MANIFEST,{cache:\"no-store\"});\n"
+	"\tconst m=await res.clone().json();\n"
+	"\tif(m.version!==VERSION)throw new Error(\"precache manifest of another version\");\n"
+	"\tconst cache=await caches.open(CACHE);\n"
+	"\tconst todo=Object.entries(m.files);\n"
+	"\tconst next=async()=>{\n"
+	"\t\tfor(let f;(f=todo.shift());){\n"
+	"\t\t\tlet r=await caches.match(key(f[0],f[1]));\n"
+	"\t\t\tif(!r){\n"
+	"\t\t\t\tr=await fetch(ROOT+encodeURI(f[0]),{cache:\"no-cache\"});\n"
+	"\t\t\t\tif(!r.ok||!(r.headers.get(\"ETag\")||\"\").includes(f[1]))throw new Error(f[0]+\" changed\");\n"
+	"\t\t\t}\n"
+	"\t\t\tawait cache.put(key(f[0],f[1]),r);\n"
+	"\t\t}\n"
+	"\t};\n"
+	"\t//The device only serves a couple of connections\n"
+	"\tawait Promise.all([next(),next()]);\n"
+	"\tawait cache.put(MANIFEST,res);\n"
+	"\tawait self.skipWaiting();\n"
+	"})()));\n"
+	"\n"
+	"self.addEventListener(\"activate\",e=>e.waitUntil((async()=>{\n"
+	"\tfor(const k of await caches.keys())if(k.startsWith(\"espfs-\")&&k!==CACHE)await caches.delete(k);\n"
+	"\tawait self.clients.claim();\n"
+	"})()));\n"
+	"\n"
+	"self.addEventListener(\"fetch\",e=>{\n"
+	"\tconst req=e.request;\n"
+	"\tif(req.method!==\"GET\"||req.headers.has(\"range\")||!req.url.startsWith(ROOT))return;\n"
+	"\te.respondWith((async()=>{\n"
+	"\t\tlet fallback=null;\n"
+	"\t\ttry{\n"
+	"\t\t\tif(!manifest)manifest=await(await(await caches.open(CACHE)).match(MANIFEST)).json();\n"
+	"\t\t\tconst url=new URL(req.url);\n"
+	"\t\t\tconst has=p=>typeof manifest.files[p]===\"string\";\n"
+	"\t\t\tlet path=decodeURI((url.origin+url.pathname).slice(ROOT.length));\n"
+	"\t\t\tif(typeof manifest.aliases[path]===\"string\")path=manifest.aliases[path];\n"
+	"\t\t\tif(has(path)){\n"
+	"\t\t\t\tconst r=await caches.match(key(path,manifest.files[path]));\n"
+	"\t\t\t\tif(r)return r;\n"
+	"\t\t\t}else if(req.mode===\"navigate\"&&has(manifest.fallback)&&!/\\.[^/]*$/.test(path)){\n"
+	"\t\t\t\t//Other routes of the server may answer for it, the fallback only stands in offline\n"
+	"\t\t\t\tfallback=await caches.match(key(manifest.fallback,manifest.files[manifest.fallback]));\n"
+	"\t\t\t}\n"
+	"\t\t}catch(err){}\n"
+	"\t\ttry{\n"
+	"\t\t\treturn await fetch(req);\n"
+	"\t\t}catch(err){\n"
+	"\t\t\tif(fallback)return fallback;\n"
+	"\t\t\tthrow err;\n"
+	"\t\t}\n"
+	"\t})());\n"
+	"});\n";
+
+//Append s to b as a JSON string
+void bufAddJson(Buf *b, char *s) {
+	char esc[8];
+	bufAdd(b, "\"", 1);
+	for (; *s; s++) {
+		if (*s=='"' || *s=='\\') {
+			esc[0]='\\';
+			esc[1]=*s;
+			bufAdd(b, esc, 2);
+		} else if ((unsigned char)*s<0x20) {
+			sprintf(esc, "\\u%04x", *s);
+			bufAdd(b, esc, 6);
+		} else {
+			bufAdd(b, s, 1);
+		}
+	}
+	bufAdd(b, "\"", 1);
+}
+
+//Path that leads from the directory of the file stored as name to the root of the image
+void rootOf(char *name, char *out) {
+	out[0]=0;
+	for (; *name; name++) {
+		if (*name=='/') strcat(out, "../");
+	}
+}
+
+//Add a generated file to the list, stored as name with the len bytes of data
+void addGenerated(char ***names, int *count, char *name, char *data, off_t len) {
+	Asset *a;
+	int i;
+
+	for (i=0; i<*count; i++) {
+		if (strcmp(sourceName((*names)[i]), name)==0) {
+			fprintf(stderr, "%s: in the html directory already\n", name);
+			exit(1);
+		}
+	}
+	*names=realloc(*names, (*count+1)*sizeof(char *));
+	(*names)[(*count)++]=strdup(name);
+	a=addAsset(name);
+	a->generated=1;
+	a->data=data;
+	a->size=len;
+}
+
+//Have the pages register the service worker, unless they do so themselves: a script doing that
+//goes before the end of the head (or body).
+void registerServiceWorker(char **names, int count) {
+	char root[1024];
+	char *data, *end;
+	off_t size, at;
+	Buf b;
+	Asset *a;
+	int i;
+
+	for (i=0; i<count; i++) {
+		if (!isFile(names[i]) || !hasExtension(names[i], "html,htm")) continue;
+		data=loadFile(names[i], &size);
+		if (data==NULL) {
+			perror(names[i]);
+			exit(1);
+		}
+		if (findCase(data, size, "serviceWorker")>=0) {
+			unloadFile(names[i], data, size);
+			continue;
+		}
+		at=findCase(data, size, "</head");
+		if (at<0) at=findCase(data, size, "</body");
+		if (at<0) at=size;
+		rootOf(storedName(names[i]), root);
+		b.data=NULL;
+		b.len=0;
+		b.size=0;
+		bufAdd(&b, data, at);
+		end="<script>if(\"serviceWorker\" in navigator)navigator.serviceWorker.register(\"";
+		bufAdd(&b, end, strlen(end));
+		bufAdd(&b, root, strlen(root));
+		bufAdd(&b, serviceWorker, strlen(serviceWorker));
+		end="\")</script>";
+		bufAdd(&b, end, strlen(end));
+		bufAdd(&b, data+at, size-at);
+		a=addAsset(names[i]);
+		if (a->data==data) free(data); else unmapFile(data, size);
+		a->data=b.data;
+		a->size=b.len;
+	}
+}
+
+//Add the service worker (-W) and the precache manifest it goes by, precache.json next to it, to
+//the list. The manifest has the hash of every file as the image stores it (which its ETag starts
+//with), the directories and other aliases served by a file, the fallback file, and a version:
+//the hash of all that.
+void addServiceWorker(char ***names, int *count, char *indexName, char *fallbackName) {
+	char manifestName[1024], root[1024], version[20];
+	char *data, *name, *srcName, *base, *list, *alias, *fallback=NULL, *script;
+	off_t size;
+	Policy policy;
+	Buf files, aliases, body, manifest;
+	int i, precached=0;
+
+	registerServiceWorker(*names, *count);
+
+	memset(&files, 0, sizeof(files));
+	memset(&aliases, 0, sizeof(aliases));
+	for (i=0; i<*count; i++) {
+		if (!isFile((*names)[i]) || !isReadable((*names)[i])) continue;
+		name=storedName((*names)[i]);
+		filePolicy(name, &policy);
+		if (policy.precache==0) continue;
+		data=loadFile((*names)[i], &size);
+		if (data==NULL) {
+			perror((*names)[i]);
+			exit(1);
+		}
+		snprintf(version, sizeof(version), "%016llx", (unsigned long long)hashContent(data, size));
+		unloadFile((*names)[i], data, size);
+		if (precached++>0) bufAdd(&files, ",", 1);
+		bufAdd(&files, "\n", 1);
+		bufAddJson(&files, name);
+		bufAdd(&files, ":", 1);
+		bufAddJson(&files, version);
+
+		srcName=sourceName((*names)[i]);
+		base=strrchr(srcName, '/');
+		base=(base==NULL)?srcName:base+1;
+		if (indexName!=NULL && strcmp(base, indexName)==0) {
+			//The directory, with its trailing slash
+			char c=*base;
+			*base=0;
+			if (aliases.len>0) bufAdd(&aliases, ",", 1);
+			bufAddJson(&aliases, srcName);
+			*base=c;
+			bufAdd(&aliases, ":", 1);
+			bufAddJson(&aliases, name);
+		}
+		if (policy.aliases!=NULL) {
+			list=strdup(policy.aliases);
+			for (alias=strtok(list, ","); alias!=NULL; alias=strtok(NULL, ",")) {
+				while (alias[0]=='/') alias++;
+				if (aliases.len>0) bufAdd(&aliases, ",", 1);
+				bufAddJson(&aliases, alias);
+				bufAdd(&aliases, ":", 1);
+				bufAddJson(&aliases, name);
+			}
+			free(list);
+		}
+		if (fallbackName!=NULL && strcmp(srcName, fallbackName)==0) fallback=name;
+	}
+
+	memset(&body, 0, sizeof(body));
+	bufAdd(&body, "\"fallback\":", 11);
+	if (fallback!=NULL) bufAddJson(&body, fallback); else bufAdd(&body, "null", 4);
+	bufAdd(&body, ",\n\"aliases\":{", 13);
+	bufAdd(&body, aliases.data, aliases.len);
+	bufAdd(&body, "},\n\"files\":{", 12);
+	bufAdd(&body, files.data, files.len);
+	bufAdd(&body, "\n}}\n", 4);
+	snprintf(version, sizeof(version), "%016llx",
+			(unsigned long long)hashContent(body.data, body.len));
+	memset(&manifest, 0, sizeof(manifest));
+	bufAdd(&manifest, "{\"version\":\"", 12);
+	bufAdd(&manifest, version, strlen(version));
+	bufAdd(&manifest, "\",\n", 3);
+	bufAdd(&manifest, body.data, body.len);
+	free(files.data);
+	free(aliases.data);
+	free(body.data);
+
+	base=strrchr(serviceWorker, '/');
+	base=(base==NULL)?serviceWorker:base+1;
+	snprintf(manifestName, sizeof(manifestName), "%.*sprecache.json", (int)(base-serviceWorker),
+			serviceWorker);
+	addGenerated(names, count, manifestName, manifest.data, manifest.len);
+
+	rootOf(serviceWorker, root);
+	if (root[0]==0) strcpy(root, "./");
+	size=snprintf(NULL, 0, serviceWorkerScript, version, "precache.json", root);
+	script=malloc(size+1);
+	snprintf(script, size+1, serviceWorkerScript, version, "precache.json", root);
+	addGenerated(names, count, serviceWorker, script, size);
+	fprintf(stderr, "%s: precaching %d files, version %s\n", serviceWorker, precached, version);
+}
+
+//Append the response header block of a 200 for the stored data as an ATTR_HEADERS attribute
+int addHeaders(char *buf, int len, char *name, Policy *p, int flags, char *etag, int size,
+		int vary) {
+	char headers[768];
+	int hlen;
+	hlen=snprintf(headers, sizeof(headers),
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %d\r\n"
+			"Cache-Control: %s\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"ETag: %s\r\n"
+			"%s%s",
+			(p->mime!=NULL)?p->mime:mimeType(name), size,
+			(p->cache!=NULL)?p->cache:ESPFS_CACHE_CONTROL, etag,
+			(flags & FLAG_GZIP)?"Content-Encoding: gzip\r\n":
+			(flags & FLAG_BROTLI)?"Content-Encoding: br\r\n":"",
+			vary?"Vary: Accept-Encoding\r\n":"");
+	if (hlen>=sizeof(headers)) {
+		fprintf(stderr, "%s: response headers don't fit in %d bytes\n", name, (int)sizeof(headers));
+		exit(1);
+	}
+	return addAttr(buf, len, ATTR_HEADERS, headers, hlen);
+}
+
+//Size an entry takes up in the image
+int entrySize(char *name, int attrLen, int csize) {
+	int nameLen=strlen(name)+1;
+	return sizeof(EspFsHeader)+((nameLen+3)&~3)+attrLen+((csize+3)&~3);
+}
+
+//Bytes written to the image so far
+long imagePos=0;
+
+//Write an entry to the image
+void writeEntry(char *name, int flags, int compression, char *attrs, int attrLen,
+		char *cdat, int csize, int size) {
+	EspFsHeader h;
+	int nameLen;
+
+	if (prefetching) return;
+
+	//Fill header data
+	h.magic=ESPFS_MAGIC;
+	h.flags=flags;
+	h.compression=compression;
+	h.nameLen=nameLen=strlen(name)+1;
+	if (h.nameLen&3) h.nameLen+=4-(h.nameLen&3); //Round to next 32bit boundary
+	h.nameLen=htoxs(h.nameLen);
+	h.fileLenComp=htoxl(csize);
+	h.fileLenDecomp=htoxl(size);
+	h.attrLen=htoxl(attrLen);
+
+	imagePos+=entrySize(name, attrLen, csize);
+	writeOut(&h, sizeof(EspFsHeader));
+	writeOut(name, nameLen);
+	padOut(nameLen);
+	writeOut(attrs, attrLen);
+	writeOut(cdat, csize);
+	padOut(csize);
+}
+
+typedef struct {
+	char *name;
+	int flags;
+	long target; //image position of the entry the alias resolves to
+} Alias;
+
+Alias *aliases=NULL;
+int aliasCount=0;
+
+void addAlias(char *name, int flags, long target) {
+	aliases=realloc(aliases, (aliasCount+1)*sizeof(Alias));
+	if (aliases==NULL) {
+		perror("allocating aliases");
+		exit(1);
+	}
+	aliases[aliasCount].name=strdup(name);
+	aliases[aliasCount].flags=flags;
+	aliases[aliasCount].target=target;
+	aliasCount++;
+}
+
+//Write the data-less entries that make the aliases resolve to their targets.
+void writeAliases() {
+	char attrs[sizeof(EspFsAttr)+4];
+	int32_t offset;
+	int i;
+	for (i=0; i<aliasCount; i++) {
+		offset=htoxl(aliases[i].target-imagePos);
+		writeEntry(aliases[i].name, aliases[i].flags|FLAG_ALIAS, COMPRESS_NONE, attrs,
+				addAttr(attrs, 0, ATTR_ALIAS, &offset, 4), NULL, 0, 0);
+		fprintf(stderr, "/%s (%s)\n", aliases[i].name,
+				(aliases[i].flags & FLAG_FALLBACK)?"fallback":"alias");
+		free(aliases[i].name);
+	}
+	free(aliases);
+}
+
+typedef struct {
+	uint64_t hash;
+	off_t size;
+	char *path;
+	char *ext; //everything name dependent goes by the extension and the manifest
+	Policy policy;
+	long pos;
+} Blob;
+
+//Files stored so far, so files with the same contents are stored as aliases of them
+Blob *blobs=NULL;
+int blobCount=0;
+
+char *extension(char *name) {
+	char *base=strrchr(name, '/');
+	char *ext=strrchr((base==NULL)?name:base, '.');
+	return (ext==NULL)?"":ext;
+}
+
+//Returns the image position of a file stored earlier with the same contents as path, that is
+//stored the same way as name is. If there is none, path is remembered as stored at the current
+//position and -1 is returned.
+long findBlob(char *path, char *name) {
+	char *data, *other;
+	off_t size, otherSize;
+	uint64_t hash;
+	Policy policy;
+	int i, same;
+
+	filePolicy(name, &policy);
+	data=loadFile(path, &size);
+	if (data==NULL) return -1;
+	hash=hashContent(data, size);
+	for (i=0; i<blobCount; i++) {
+		if (blobs[i].hash!=hash || blobs[i].size!=size || strcmp(blobs[i].ext, extension(name))!=0 ||
+				!samePolicy(&blobs[i].policy, &policy)) {
+			continue;
+		}
+		//Don't trust the hash alone
+		other=loadFile(blobs[i].path, &otherSize);
+		same=(other!=NULL && otherSize==size && memcmp(data, other, size)==0);
+		unloadFile(blobs[i].path, other, otherSize);
+		if (same) {
+			unloadFile(path, data, size);
+			return blobs[i].pos;
+		}
+	}
+	unloadFile(path, data, size);
+
+	blobs=realloc(blobs, (blobCount+1)*sizeof(Blob));
+	if (blobs==NULL) {
+		perror("allocating blobs");
+		exit(1);
+	}
+	blobs[blobCount].hash=hash;
+	blobs[blobCount].size=size;
+	blobs[blobCount].path=strdup(path);
+	blobs[blobCount].ext=strdup(extension(name));
+	blobs[blobCount].policy=policy;
+	blobs[blobCount].pos=imagePos;
+	blobCount++;
+	return -1;
+}
+
+int handleFile(char *path, char *name, int compression, int level, int blockSize, char **compName) {
+	char *fdat, *cdat;
+	off_t size, csize;
+	int8_t flags = 0;
+	char *attrs;
+	int attrLen=0;
+	char etag[32];
+	int32_t *blockOffs=NULL;
+	int nblocks=0;
+	int32_t *lz4Offs;
+	int lz4Blocks;
+	int lz4Block=lz4BlockSize;
+	Policy policy;
+#ifdef ESPFS_GZIP
+	int gzipCodec=tune?CODEC_GZIP_TUNED:CODEC_GZIP;
+	int gzip;
+#endif
+#ifdef ESPFS_HEATSHRINK
+	int hsCodec=tune?CODEC_HEATSHRINK_TUNED:CODEC_HEATSHRINK;
+	int hsParams;
+	int primed=0;
+#endif
+
+	filePolicy(name, &policy);
+	if (policy.compression>=0) compression=policy.compression;
+	if (policy.level>0) level=policy.level;
+#ifdef ESPFS_GZIP
+	gzip=gzipFile(name, &policy);
+#endif
+#ifdef ESPFS_HEATSHRINK
+	hsParams=tune?tuneWindow:heatshrinkParams(level);
+#endif
+	fdat=loadFile(path, &size);
+	if (fdat==NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	//Only files spanning several blocks are worth splitting up
+	if (blockSize>0 && size>blockSize) {
+		//The block table has to fit in one attribute
+		while ((size+blockSize-1)/blockSize >= 0x7fff/sizeof(int32_t)) blockSize*=2;
+		nblocks=(size+blockSize-1)/blockSize;
+		blockOffs=malloc((nblocks+1)*sizeof(int32_t));
+		blockOffs[0]=htoxl(blockSize);
+	} else {
+		blockSize=0;
+	}
+	//LZ4 data always comes in blocks
+	while ((size+lz4Block-1)/lz4Block >= 0x7fff/sizeof(int32_t)) lz4Block*=2;
+	lz4Blocks=(size+lz4Block-1)/lz4Block;
+	lz4Offs=malloc((lz4Blocks+1)*sizeof(int32_t));
+	lz4Offs[0]=htoxl(lz4Block);
+	attrs=malloc(1024+policyAttrsSize(&policy)+(nblocks+lz4Blocks+2)*sizeof(int32_t));
+
+
+#ifdef ESPFS_GZIP
+	if (gzip && variantEncodings==0) {
+		csize = gzipBound(size);
+		cdat=malloc(csize);
+		csize=compressCached(gzipCodec, fdat, size, cdat, csize, level, 0, NULL, 0, NULL, 0);
+		compression = COMPRESS_NONE;
+		flags = FLAG_GZIP;
+	} else
+#endif
+	if (compression==COMPRESS_NONE) {
+		csize=size;
+		cdat=fdat;
+#ifdef ESPFS_HEATSHRINK
+	} else if (compression==COMPRESS_HEATSHRINK) {
+		cdat=malloc(heatshrinkBound(size, nblocks));
+		csize=compressCached(hsCodec, fdat, size, cdat, heatshrinkBound(size, nblocks), hsParams,
+				blockSize, (nblocks>0)?blockOffs+1:NULL, nblocks, NULL, 0);
+		//Keep the version compressed against the dictionary if that comes out smaller
+		if (dictLen>0) {
+			char *ddat=malloc(heatshrinkBound(size, nblocks));
+			int32_t *dblockOffs=(nblocks>0)?malloc((nblocks+1)*sizeof(int32_t)):NULL;
+			off_t dsize=compressCached(hsCodec, fdat, size, ddat, heatshrinkBound(size, nblocks),
+					hsParams, blockSize, (dblockOffs!=NULL)?dblockOffs+1:NULL, nblocks, dict, dictLen);
+			if (dsize<csize) {
+				free(cdat);
+				cdat=ddat;
+				csize=dsize;
+				if (dblockOffs!=NULL) memcpy(blockOffs+1, dblockOffs+1, nblocks*sizeof(int32_t));
+				primed=1;
+			} else {
+				free(ddat);
+			}
+			free(dblockOffs);
+		}
+		//Trade some size for decoding speed where the fast codec comes close enough
+		if (lz4Slack>=0 && csize<=size) {
+			char *ldat=malloc(lz4Bound(size));
+			off_t lsize=compressCached(CODEC_LZ4, fdat, size, ldat, lz4Bound(size), 0, lz4Block,
+					lz4Offs+1, lz4Blocks, NULL, 0);
+			if (lsize*100<=csize*(100+lz4Slack)) {
+				free(cdat);
+				cdat=ldat;
+				csize=lsize;
+				compression=COMPRESS_LZ4;
+			} else {
+				free(ldat);
+			}
+		}
+#endif
+	} else if (compression==COMPRESS_LZ4) {
+		cdat=malloc(lz4Bound(size));
+		csize=compressCached(CODEC_LZ4, fdat, size, cdat, lz4Bound(size), 0, lz4Block, lz4Offs+1,
+				lz4Blocks, NULL, 0);
+	} else {
+		fprintf(stderr, "Unknown compression - %d\n", compression);
+		exit(1);
+	}
+
+	if (csize>size) {
+		//Compressing enbiggened this file. Revert to uncompressed store.
+		compression=COMPRESS_NONE;
+		csize=size;
+		cdat=fdat;
+		flags=0;
+	}
+
+	//Strong ETag of the stored representation; gzip-encoded data gets its own tag
+	snprintf(etag, sizeof(etag), "\"%016llx%s\"", (unsigned long long)hashContent(fdat, size),
+			(flags & FLAG_GZIP)?"-gzip":"");
+	attrLen=addAttr(attrs, attrLen, ATTR_ETAG, etag, strlen(etag)+1);
+	attrLen=addPolicyAttrs(attrs, attrLen, &policy);
+
+#ifdef ESPFS_GZIP
+	if (flags & FLAG_GZIP) {
+		int8_t window=gzipWindowBits;
+		attrLen=addAttr(attrs, attrLen, ATTR_GZIP_WINDOW, &window, 1);
+	}
+#endif
+
+#ifdef ESPFS_HEATSHRINK
+	if (compression==COMPRESS_HEATSHRINK && primed) {
+		int32_t offset=htoxl(dictPos-imagePos);
+		attrLen=addAttr(attrs, attrLen, ATTR_DICTIONARY, &offset, 4);
+	}
+#endif
+
+	if (compression==COMPRESS_HEATSHRINK && blockSize>0) {
+		attrLen=addAttr(attrs, attrLen, ATTR_BLOCKS, blockOffs, (nblocks+1)*sizeof(int32_t));
+	} else if (compression==COMPRESS_LZ4) {
+		attrLen=addAttr(attrs, attrLen, ATTR_BLOCKS, lz4Offs, (lz4Blocks+1)*sizeof(int32_t));
+	}
+
+#ifdef ESPFS_GZIP
+	//Store the other encodings this file compresses smaller with as variants behind it
+	if (variantEncodings!=0 && gzip) {
+		int32_t offs[2];
+		int nvar=0, i;
+		int vflags[2]={0, 0};
+		char *vdat[2]={NULL, NULL};
+		off_t vsize[2]={0, 0};
+		char *vattrs[2];
+		int vattrLen[2];
+		int offset;
+
+		if (variantEncodings & ENCODING_GZIP) {
+			vsize[nvar]=gzipBound(size);
+			vdat[nvar]=malloc(vsize[nvar]);
+			vsize[nvar]=compressCached(gzipCodec, fdat, size, vdat[nvar], vsize[nvar], level, 0,
+					NULL, 0, NULL, 0);
+			vflags[nvar]=FLAG_GZIP;
+			if (vsize[nvar]<csize) nvar++; else free(vdat[nvar]);
+		}
+#ifdef ESPFS_BROTLI
+		if (variantEncodings & ENCODING_BROTLI) {
+			vsize[nvar]=BrotliEncoderMaxCompressedSize(size);
+			if (vsize[nvar]==0) vsize[nvar]=size*2+1024;
+			vdat[nvar]=malloc(vsize[nvar]);
+			vsize[nvar]=compressCached(CODEC_BROTLI, fdat, size, vdat[nvar], vsize[nvar], 0, 0,
+					NULL, 0, NULL, 0);
+			vflags[nvar]=FLAG_BROTLI;
+			if (vsize[nvar]<csize) nvar++; else free(vdat[nvar]);
+		}
+#endif
+
+		if (prebakeHeaders) {
+			attrLen=addHeaders(attrs, attrLen, name, &policy, flags, etag,
+					(flags & FLAG_GZIP)?csize:size, (flags & FLAG_GZIP) || nvar>0);
+		}
+
+		for (i=0; i<nvar; i++) {
+			vattrs[i]=malloc(1024+policyAttrsSize(&policy));
+			snprintf(etag, sizeof(etag), "\"%016llx%s\"", (unsigned long long)hashContent(fdat, size),
+					(vflags[i] & FLAG_GZIP)?"-gzip":"-br");
+			vattrLen[i]=addAttr(vattrs[i], 0, ATTR_ETAG, etag, strlen(etag)+1);
+			vattrLen[i]=addPolicyAttrs(vattrs[i], vattrLen[i], &policy);
+			if (vflags[i] & FLAG_GZIP) {
+				int8_t window=gzipWindowBits;
+				vattrLen[i]=addAttr(vattrs[i], vattrLen[i], ATTR_GZIP_WINDOW, &window, 1);
+			}
+			if (prebakeHeaders) {
+				vattrLen[i]=addHeaders(vattrs[i], vattrLen[i], name, &policy, vflags[i], etag,
+						vsize[i], 1);
+			}
+		}
+
+		if (nvar>0) {
+			//Offsets are relative to the primary header, which needs to know its own size first
+			offset=entrySize(name, attrLen+sizeof(EspFsAttr)+nvar*sizeof(int32_t), csize);
+			for (i=0; i<nvar; i++) {
+				offs[i]=htoxl(offset);
+				offset+=entrySize(name, vattrLen[i], vsize[i]);
+			}
+			attrLen=addAttr(attrs, attrLen, ATTR_VARIANTS, offs, nvar*sizeof(int32_t));
+		}
+
+		writeEntry(name, flags, compression, attrs, attrLen, cdat, csize, size);
+		for (i=0; i<nvar; i++) {
+			writeEntry(name, vflags[i]|FLAG_VARIANT, COMPRESS_NONE, vattrs[i], vattrLen[i],
+					vdat[i], vsize[i], size);
+			if (!prefetching) {
+				fprintf(stderr, "%s (%d%%, %s)\n", name, size ? (int)((vsize[i]*100)/size) : 100,
+						(vflags[i] & FLAG_GZIP)?"gzip":"br");
+			}
+			free(vdat[i]);
+			free(vattrs[i]);
+		}
+	} else
+#endif
+	{
+		if (prebakeHeaders) {
+			attrLen=addHeaders(attrs, attrLen, name, &policy, flags, etag,
+					(flags & FLAG_GZIP)?csize:size, flags & FLAG_GZIP);
+		}
+		writeEntry(name, flags, compression, attrs, attrLen, cdat, csize, size);
+	}
+
+	if (cdat!=fdat) free(cdat);
+	unloadFile(path, fdat, size);
+	free(attrs);
+	free(blockOffs);
+	free(lz4Offs);
+
+	if (compName != NULL) {
+		if (compression==COMPRESS_HEATSHRINK) {
+			*compName = "heatshrink";
+		} else if (compression==COMPRESS_LZ4) {
+			*compName = "lz4";
+		} else if (compression==COMPRESS_NONE) {
+			if (flags & FLAG_GZIP) {
+				*compName = "gzip";
+			} else {
+				*compName = "none";
+			}
+		} else {
+			*compName = "unknown";
+		}
+	}
+	return size ? (csize*100)/size : 100;
+}
+
+//Write final dummy header with FLAG_LASTFILE set.
+void finishArchive() {
+	EspFsHeader h;
+	h.magic=ESPFS_MAGIC;
+	h.flags=FLAG_LASTFILE;
+	h.compression=COMPRESS_NONE;
+	h.nameLen=htoxs(0);
+	h.fileLenComp=htoxl(0);
+	h.fileLenDecomp=htoxl(0);
+	h.attrLen=htoxl(0);
+	writeAliases();
+	writeOut(&h, sizeof(EspFsHeader));
+	flushOut();
+}
+
+#ifdef ESPFS_HEATSHRINK
+//Build the dictionary from the small files that will be heatshrink compressed, and write it as
+//the first entry of the image.
+void writeDictionary(char **names, int count, int size, int level) {
+	int window=tune?tuneWindow:heatshrinkParams(level)>>4;
+	char **samples=malloc(count*sizeof(char *));
+	int *sizes=malloc(count*sizeof(int));
+	int n=0, total=0, i;
+	Policy policy;
+	char *data;
+	off_t fileSize;
+
+	//Only the end of the dictionary fits in the window
+	if (size>1<<window) size=1<<window;
+
+	for (i=0; i<count && total<DICT_SAMPLES_TOTAL; i++) {
+		if (!isFile(names[i])) continue;
+		filePolicy(storedName(names[i]), &policy);
+		if (policy.compression>=0 && policy.compression!=COMPRESS_HEATSHRINK) continue;
+#ifdef ESPFS_GZIP
+		if (gzipFile(storedName(names[i]), &policy) && variantEncodings==0) continue;
+#endif
+		//Samples are what goes into the image, after the earlier stages
+		data=loadFile(names[i], &fileSize);
+		if (data==NULL) continue;
+		if (fileSize>0 && fileSize<=DICT_SAMPLE_SIZE) {
+			samples[n]=malloc(fileSize);
+			memcpy(samples[n], data, fileSize);
+			sizes[n]=fileSize;
+			total+=sizes[n++];
+		}
+		unloadFile(names[i], data, fileSize);
+	}
+
+	dict=malloc(size);
+	dictLen=buildDictionary(samples, sizes, n, dict, size);
+	if (dictLen>0) {
+		dictPos=imagePos;
+		writeEntry("", FLAG_DICTIONARY, COMPRESS_NONE, NULL, 0, dict, dictLen, dictLen);
+		fprintf(stderr, "(dictionary, %d bytes from %d files)\n", dictLen, n);
+	}
+
+	for (i=0; i<n; i++) free(samples[i]);
+	free(samples);
+	free(sizes);
+}
+#endif
+
+//Make the directory path unless it's there
+int makeDir(char *path) {
+#ifdef __MINGW32__
+	if (mkdir(path)!=0 && errno!=EEXIST) return -1;
+#else
+	if (mkdir(path, 0777)!=0 && errno!=EEXIST) return -1;
+#endif
+	return 0;
+}
+
+//Write the files as the stages leave them (-M, -I, -F, -W) to dir under the names they would be
+//stored by, instead of making an image (-X)
+void exportFiles(char **names, int count, char *dir) {
+	char path[2048];
+	char *data, *p;
+	off_t size;
+	FILE *f;
+	int i;
+
+	for (i=0; i<count; i++) {
+		if (!isFile(names[i])) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, storedName(names[i]));
+		for (p=strchr(path+1, '/'); p!=NULL; p=strchr(p+1, '/')) {
+			*p=0;
+			if (makeDir(path)!=0) {
+				perror(path);
+				exit(1);
+			}
+			*p='/';
+		}
+		data=loadFile(names[i], &size);
+		if (data==NULL) {
+			perror(names[i]);
+			exit(1);
+		}
+		f=fopen(path, "wb");
+		if (f==NULL || fwrite(data, 1, size, f)!=(size_t)size || fclose(f)!=0) {
+			perror(path);
+			exit(1);
+		}
+		unloadFile(names[i], data, size);
+	}
+}
+
+//Requests further apart than this (ms) in a trace belong to different page loads
+#define TRACE_SESSION_GAP 2000
+
+//Flash cache the trace is replayed against: that of the ESP32
+#define CACHE_LINE 32
+#define CACHE_WAYS 2
+#define CACHE_SETS (32*1024/CACHE_LINE/CACHE_WAYS)
+
+typedef struct {
+	uint32_t time;
+	int file; //index in the file list
+} TraceEntry;
+
+TraceEntry *trace=NULL;
+int traceLen=0;
+
+//Copy name to out without a fingerprint nameAsset gave it. out has room for name.
+void unfingerprinted(char *name, char *out) {
+	char *base=strrchr(name, '/');
+	char *p;
+	int i;
+	strcpy(out, name);
+	base=(base==NULL)?out:out+(base-name)+1;
+	for (p=strchr(base, '.'); p!=NULL; p=strchr(p+1, '.')) {
+		for (i=1; i<=8 && ((p[i]>='0' && p[i]<='9') || (p[i]>='a' && p[i]<='f')); i++) ;
+		if (i==9 && (p[9]=='.' || p[9]==0)) {
+			memmove(p, p+9, strlen(p+9)+1);
+			break;
+		}
+	}
+}
+
+//Read the "<ms> <name>" lines espFsTraceRead produces, dropping files that aren't in the list.
+//Files are found by the names they had in the html directory, so a trace of fingerprinted names
+//still matches after their contents changed.
+void readTrace(char *traceFile, char **names, int count) {
+	FILE *f=fopen(traceFile, "r");
+	char line[1024];
+	char plain[1024];
+	char *name;
+	unsigned long time;
+	int i;
+
+	if (f==NULL) {
+		perror(traceFile);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")]=0;
+		time=strtoul(line, &name, 10);
+		if (name==line || *name!=' ') continue;
+		name=sourceName(name+1);
+		unfingerprinted(name, plain);
+		for (i=0; i<count; i++) {
+			if (strcmp(sourceName(names[i]), name)==0 || strcmp(sourceName(names[i]), plain)==0) {
+				break;
+			}
+		}
+		if (i==count) continue;
+		trace=realloc(trace, (traceLen+1)*sizeof(TraceEntry));
+		if (trace==NULL) {
+			perror("reading trace");
+			exit(1);
+		}
+		trace[traceLen].time=time;
+		trace[traceLen].file=i;
+		traceLen++;
+	}
+	fclose(f);
+}
+
+//Order the files so the ones requested in the same page loads are next to each other, starting
+//with the most requested one. Each next file is the one requested together with the files
+//placed so far the most often; when there is none, the most requested file left starts a new
+//group. Files that aren't in the trace follow in list order.
+void orderByTrace(int *order, int count) {
+	int *heat=calloc(count, sizeof(int));
+	int *first=malloc(count*sizeof(int));
+	int *hot=malloc(count*sizeof(int)); //index among the traced files
+	int *files=malloc(count*sizeof(int)); //traced files, by that index
+	int *session=malloc(count*sizeof(int));
+	int *affinity, *together;
+	char *placed;
+	int nhot=0, n=0, start, i, j, k, m, best;
+
+	for (i=0; i<count; i++) hot[i]=-1;
+	for (i=0; i<traceLen; i++) {
+		j=trace[i].file;
+		if (hot[j]<0) {
+			hot[j]=nhot;
+			files[nhot]=j;
+			first[nhot]=i;
+			nhot++;
+		}
+		heat[hot[j]]++;
+	}
+
+	//Count how often each pair of files is requested in the same page load
+	together=calloc((size_t)nhot*nhot, sizeof(int));
+	affinity=calloc(nhot, sizeof(int));
+	placed=calloc(nhot, 1);
+	for (start=0; start<traceLen; start=i) {
+		k=0;
+		for (i=start; i<traceLen; i++) {
+			if (i>start && trace[i].time-trace[i-1].time>TRACE_SESSION_GAP) break;
+			j=hot[trace[i].file];
+			if (!placed[j]) {
+				placed[j]=1;
+				session[k++]=j;
+			}
+		}
+		for (j=0; j<k; j++) {
+			placed[session[j]]=0;
+			for (m=0; m<k; m++) {
+				if (m!=j) together[session[j]*nhot+session[m]]++;
+			}
+		}
+	}
+
+	while (n<nhot) {
+		best=-1;
+		for (j=0; j<nhot; j++) {
+			if (placed[j]) continue;
+			if (best<0 || affinity[j]>affinity[best] ||
+					(affinity[j]==affinity[best] && (heat[j]>heat[best] ||
+					(heat[j]==heat[best] && first[j]<first[best])))) {
+				best=j;
+			}
+		}
+		placed[best]=1;
+		order[n++]=files[best];
+		for (j=0; j<nhot; j++) affinity[j]+=together[best*nhot+j];
+	}
+
+	for (i=0; i<count; i++) {
+		if (hot[i]<0) order[n++]=i;
+	}
+
+	free(heat);
+	free(first);
+	free(hot);
+	free(files);
+	free(session);
+	free(affinity);
+	free(together);
+	free(placed);
+}
+
+//Replay the trace against a 2-way set associative flash cache, with every request reading the
+//entry (and variants) of its file. The cache starts out cold for every page load, the code run
+//in between evicts the files. Returns the cache lines read from flash.
+long traceMisses(long *pos, long *len) {
+	long tags[CACHE_SETS][CACHE_WAYS];
+	long line;
+	long misses=0;
+	int i, set;
+
+	for (i=0; i<traceLen; i++) {
+		if (i==0 || trace[i].time-trace[i-1].time>TRACE_SESSION_GAP) {
+			memset(tags, 0xff, sizeof(tags));
+		}
+		if (len[trace[i].file]==0) continue;
+		for (line=pos[trace[i].file]/CACHE_LINE;
+				line<=(pos[trace[i].file]+len[trace[i].file]-1)/CACHE_LINE; line++) {
+			set=line%CACHE_SETS;
+			if (tags[set][0]==line) continue;
+			//Least recently used way goes, the one hit moves to the front
+			if (tags[set][1]!=line) misses++;
+			tags[set][1]=tags[set][0];
+			tags[set][0]=line;
+		}
+	}
+	return misses;
+}
+
+//Report how the layout does on the trace, against the files stored in list order.
+void benchmarkTrace(long *pos, long *len, int count) {
+	long *listPos=malloc(count*sizeof(long));
+	long p=-1;
+	int i;
+
+	for (i=0; i<count; i++) {
+		if (len[i]>0 && (p<0 || pos[i]<p)) p=pos[i];
+	}
+	for (i=0; i<count; i++) {
+		listPos[i]=p;
+		p+=len[i];
+	}
+	fprintf(stderr, "Trace: %d requests, %ld flash cache misses in list order, %ld laid out by the "
+			"trace\n", traceLen, traceMisses(listPos, len), traceMisses(pos, len));
+	free(listPos);
+}
+
+typedef struct {
+	char **names;
+	int count;
+	int next; //file the next thread to ask gets
+	int compression;
+	int level;
+	int blockSize;
+} Prefetch;
+
+//Job thread: compress files the way handleFile will, to have the results ready in the cache.
+void *prefetchFiles(void *arg) {
+	Prefetch *p=(Prefetch *)arg;
+	int x;
+
+	while (1) {
+		pthread_mutex_lock(&resultLock);
+		x=p->next++;
+		pthread_mutex_unlock(&resultLock);
+		if (x>=p->count) return NULL;
+		if (!isFile(p->names[x]) || !isReadable(p->names[x])) continue;
+		handleFile(p->names[x], storedName(p->names[x]), p->compression, p->level, p->blockSize,
+				NULL);
+	}
+}
+
+//Compress all files on jobs threads before the image is written.
+void prefetchAll(char **names, int count, int compression, int level, int blockSize) {
+	pthread_t *threads=malloc(jobs*sizeof(pthread_t));
+	Prefetch p={names, count, 0, compression, level, blockSize};
+	int i, n;
+
+	prefetching=1;
+	for (n=0; n<jobs; n++) {
+		if (pthread_create(&threads[n], NULL, prefetchFiles, &p)!=0) break;
+	}
+	//Without any threads, handleFile compresses the files while writing them
+	for (i=0; i<n; i++) pthread_join(threads[i], NULL);
+	prefetching=0;
+	free(threads);
+}
+
+int main(int argc, char **argv) {
+	int x;
+	char fileName[1024];
+	char **names=NULL;
+	int nameCount=0;
+#ifdef ESPFS_HEATSHRINK
+	int dictSize=0;
+#endif
+	char *realName;
+	char *srcName;
+	struct stat statBuf;
+	int rate;
+	int err=0;
+	int compType;  //default compression type - heatshrink
+	int compLvl=-1;
+	int blockSize=0;
+	int tuneRam=0;
+	char *indexName=NULL;
+	char *fallbackName=NULL;
+	char *traceFile=NULL;
+	char *manifestFile=NULL;
+	char *exportDir=NULL;
+	Policy policy;
+	int *order;
+	long *filePos, *fileLen;
+	long pos;
+	char *base;
+
+#ifdef __MINGW32__
+	setmode(fileno(stdout), O_BINARY);
+#endif
+#ifdef ESPFS_HEATSHRINK
+	compType = COMPRESS_HEATSHRINK;
+#else
+	compType = COMPRESS_NONE;
+#endif
+
+	for (x=1; x<argc; x++) {
+		if (strcmp(argv[x], "-c")==0 && argc>=x-2) {
+			compType=atoi(argv[x+1]);
+			x++;
+		} else if (strcmp(argv[x], "-l")==0 && argc>=x-2) {
+			compLvl=atoi(argv[x+1]);
+			if (compLvl<1 || compLvl>9) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-b")==0 && argc>=x-2) {
+			blockSize=atoi(argv[x+1]);
+			if (blockSize<0) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-B")==0 && argc>=x-2) {
+			lz4BlockSize=atoi(argv[x+1]);
+			if (lz4BlockSize<64) err=1;
+			x++;
+#ifdef ESPFS_HEATSHRINK
+		} else if (strcmp(argv[x], "-f")==0 && argc>=x-2) {
+			lz4Slack=atoi(argv[x+1]);
+			if (lz4Slack<0) err=1;
+			x++;
+#endif
+#ifdef ESPFS_HEATSHRINK
+		} else if (strcmp(argv[x], "-d")==0 && argc>=x-2) {
+			dictSize=atoi(argv[x+1]);
+			if (dictSize<0) err=1;
+			x++;
+#endif
+		} else if (strcmp(argv[x], "-j")==0 && argc>=x-2) {
+			jobs=atoi(argv[x+1]);
+			if (jobs<1) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-C")==0 && argc>=x-2) {
+			cacheDir=argv[x+1];
+			x++;
+		} else if (strcmp(argv[x], "-t")==0 && argc>=x-2) {
+			traceFile=argv[x+1];
+			x++;
+		} else if (strcmp(argv[x], "-F")==0) {
+			fingerprint=1;
+		} else if (strcmp(argv[x], "-W")==0 && argc>=x-2) {
+			serviceWorker=argv[x+1];
+			while (serviceWorker[0]=='/') serviceWorker++;
+			if (serviceWorker[0]==0) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-M")==0) {
+			minify=1;
+		} else if (strcmp(argv[x], "-I")==0 && argc>=x-2) {
+			inlineSize=atoi(argv[x+1]);
+			if (inlineSize<0) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-X")==0 && argc>=x-2) {
+			exportDir=argv[x+1];
+			x++;
+		} else if (strcmp(argv[x], "-m")==0 && argc>=x-2) {
+			manifestFile=argv[x+1];
+			x++;
+		} else if (strcmp(argv[x], "-O")==0) {
+			tune=1;
+		} else if (strcmp(argv[x], "-r")==0 && argc>=x-2) {
+			tuneRam=atoi(argv[x+1]);
+			if (tuneRam<16) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-H")==0) {
+			prebakeHeaders=1;
+		} else if (strcmp(argv[x], "-i")==0 && argc>=x-2) {
+			indexName=argv[x+1];
+			x++;
+		} else if (strcmp(argv[x], "-s")==0 && argc>=x-2) {
+			fallbackName=argv[x+1];
+			while (fallbackName[0]=='/') fallbackName++;
+			x++;
+#ifdef ESPFS_GZIP
+		} else if (strcmp(argv[x], "-g")==0 && argc>=x-2) {
+			if (!parseGzipExtensions(argv[x+1])) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-w")==0 && argc>=x-2) {
+			gzipWindowBits=atoi(argv[x+1]);
+			if (gzipWindowBits<9 || gzipWindowBits>15) err=1;
+			x++;
+		} else if (strcmp(argv[x], "-e")==0 && argc>=x-2) {
+			if (!parseEncodings(argv[x+1])) err=1;
+			x++;
+#endif
+		} else {
+			err=1;
+		}
+	}
+
+#ifdef ESPFS_GZIP
+	if (gzipExtensions == NULL) {
+		parseGzipExtensions(strdup("html,css,js,svg"));
+	}
+#endif
+
+#ifdef ESPFS_HEATSHRINK
+	if (tune) {
+		if (tuneRam==0) tuneRam=1<<(heatshrinkParams(compLvl)>>4);
+		tuneWindow=HEATSHRINK_MIN_WINDOW_BITS;
+		while (tuneWindow<HEATSHRINK_MAX_WINDOW_BITS && 2<<tuneWindow<=tuneRam) tuneWindow++;
 	}
 #endif
 
 	if (err) {
 		fprintf(stderr, "%s - Program to create espfs images\n", argv[0]);
-		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] ", argv[0]);
+		fprintf(stderr, "Usage: \nfind | %s [-c compressor] [-l compression_level] [-b block_size] ", argv[0]);
+		fprintf(stderr, "[-B lz4_block_size] ");
+#ifdef ESPFS_HEATSHRINK
+		fprintf(stderr, "[-f lz4_slack] [-d dictionary_size] [-r decoder_ram] ");
+#endif
+		fprintf(stderr, "[-O] [-H] [-F] [-M] [-I inline_size] [-W service_worker] [-i index_name] [-s fallback_file] [-m manifest] [-t trace] [-X export_dir] ");
+		fprintf(stderr, "[-j jobs] ");
+		fprintf(stderr, "[-C cache_dir] ");
 #ifdef ESPFS_GZIP
-		fprintf(stderr, "[-g gzipped_extensions] ");
+		fprintf(stderr, "[-g gzipped_extensions] [-w gzip_window_bits] [-e encodings] ");
 #endif
 		fprintf(stderr, "> out.espfs\n");
 		fprintf(stderr, "Compressors:\n");
 #ifdef ESPFS_HEATSHRINK
-		fprintf(stderr, "0 - None\n1 - Heatshrink(default)\n");
+		fprintf(stderr, "0 - None\n1 - Heatshrink(default)\n2 - LZ4\n");
 #else
-		fprintf(stderr, "0 - None(default)\n");
+		fprintf(stderr, "0 - None(default)\n2 - LZ4\n");
 #endif
 		fprintf(stderr, "\nCompression level: 1 is worst but low RAM usage, higher is better compression \nbut uses more ram on decompression. -1 = compressors default.\n");
+		fprintf(stderr, "\nBlock size: compress files larger than this in independent blocks of this many \nbytes so they can be seeked into. 0 (default) compresses every file as one stream.\n");
+		fprintf(stderr, "\nLZ4 block size: LZ4 files are compressed in independent blocks of this many \nbytes (default 2048), the device needs as much RAM to read one.\n");
+#ifdef ESPFS_HEATSHRINK
+		fprintf(stderr, "\nLZ4 slack: store files with LZ4 instead of heatshrink if that is at most this \nmany percent bigger. LZ4 decodes a lot faster.\n");
+		fprintf(stderr, "\nDictionary size: build a dictionary of up to this many bytes (at most the \nheatshrink window) from the small files, to compress them against. 0 (default) \nfor none.\n");
+#endif
+		fprintf(stderr, "\n-O: try several compression parameters for every file and keep the smallest \nresult: every heatshrink window and lookahead that fits the decoder RAM, and \nzlib's most thorough deflate settings. Slow, best used with a cache dir.\n");
+#ifdef ESPFS_HEATSHRINK
+		fprintf(stderr, "\nDecoder RAM: bytes the heatshrink window of a file tuned with -O may take on \nthe device. Defaults to the window of the compression level.\n");
+#endif
+		fprintf(stderr, "\n-H: store the response headers of every file in the image, so the server can \nsend them in one go.\n");
+		fprintf(stderr, "\n-F: fingerprint every file but the html pages: store it under a name with a \nhash of its contents, e.g. app.1a2b3c4d.js, rewrite the references to it in \nquotes or url() in html, css, js and svg files, and have clients cache it for a \nyear. The files referencing them are revalidated on every use instead. Relative \npaths in js files other than modules are relative to the page, which can be any, \nso the files they may point at are left as they are.\n");
+		fprintf(stderr, "\n-M: minify html, css, js, svg and json files: drop comments and the whitespace \nthat doesn't matter. Runs of whitespace in pages are collapsed to one.\n");
+		fprintf(stderr, "\nInline size: inline the stylesheets, classic scripts, images and icons of up \nto this many bytes that pages (and stylesheets, for images) refer to, as style \nand script elements and data: URIs. 0 (default) for none.\n");
+		fprintf(stderr, "\nService worker: name to store a service worker under that keeps the files in \nthe browser's cache, with the precache manifest (hashes of the files) it goes by \nin precache.json next to it. Pages get a script registering it. After an update \nbrowsers only fetch the files whose hash changed. It only controls the pages of \nits directory, so e.g. sw.js covers all of them.\n");
+		fprintf(stderr, "\nIndex name: files with this name (e.g. index.html) are also served for their \ndirectory, 'dir/' or '/' for the root.\n");
+		fprintf(stderr, "\nFallback file: file served for paths that aren't in the image, for single page \napps.\n");
+		fprintf(stderr, "\nManifest: file of lines like '*.js compress=gzip level=9 cache=immutable', \na glob followed by settings for the files it matches, later lines overriding \nearlier ones. Globs without a '/' match the file name in any directory, * \ndoesn't match a '/', ** does. Settings:\n");
+		fprintf(stderr, "  compress=none|heatshrink|lz4|gzip  how to store the file\n");
+		fprintf(stderr, "  level=1..9                         compression level\n");
+		fprintf(stderr, "  cache=immutable|<seconds>|<value>  Cache-Control (default max-age=3600, \n");
+		fprintf(stderr, "                                     must-revalidate), no spaces in a value\n");
+		fprintf(stderr, "  mime=<type>                        Content-Type instead of the extension's\n");
+		fprintf(stderr, "  alias=<name>[,<name>...]           other paths the file is served under\n");
+		fprintf(stderr, "  fingerprint=yes|no                 whether to fingerprint it, see -F\n");
+		fprintf(stderr, "  minify=yes|no                      whether to minify it, see -M\n");
+		fprintf(stderr, "  inline=yes|no                      whether it may be inlined, see -I\n");
+		fprintf(stderr, "  precache=yes|no                    whether the service worker caches it, see -W\n");
+		fprintf(stderr, "\nTrace: access trace served by ahttpd_fs_trace_handler. Files requested together \nare stored next to each other, the most requested first, and the flash cache \nmisses of replaying the trace are reported.\n");
+		fprintf(stderr, "\nExport dir: write the files as -M, -I, -F and -W leave them to this directory, \nunder the names they would be stored by, instead of making an image.\n");
+		fprintf(stderr, "\nJobs: number of threads compressing files, defaults to the number of CPUs. \nThe image is the same for any number.\n");
+		fprintf(stderr, "\nCache dir: directory compressed files are kept in, by content and settings, \nfor later runs to reuse instead of compressing them again.\n");
 #ifdef ESPFS_GZIP
 		fprintf(stderr, "\nGzipped extensions: list of comma separated, case sensitive file extensions \nthat will be gzipped. Defaults to 'html,css,js'\n");
+		fprintf(stderr, "\nGzip window bits: 9 to 15 (default), the device needs 2^bits bytes of RAM to \ninflate a gzipped file for a client that doesn't accept gzip.\n");
+#ifdef ESPFS_BROTLI
+		fprintf(stderr, "\nEncodings: comma separated list of gzip and br. Files with a gzipped extension \nare stored as usual, followed by a variant in each of these encodings that is \nsmaller; the server picks the one the client accepts.\n");
+#else
+		fprintf(stderr, "\nEncodings: gzip. Files with a gzipped extension are stored as usual, followed \nby a gzipped variant if that is smaller; the server picks the one the client \naccepts.\n");
+#endif
 #endif
 		exit(0);
 	}
 
+	//The dictionary is built from all files before the first one is written
 	while(fgets(fileName, sizeof(fileName), stdin)) {
 		//Kill off '\n' at the end
 		fileName[strlen(fileName)-1]=0;
+		names=realloc(names, (nameCount+1)*sizeof(char *));
+		names[nameCount++]=strdup(fileName);
+	}
+
+	if (manifestFile!=NULL) {
+		readManifest(manifestFile);
+	}
+	minifyFiles(names, nameCount);
+	if (inlineSize>0) {
+		inlineFiles(names, nameCount);
+	}
+	fingerprintFiles(names, nameCount);
+	if (serviceWorker!=NULL) {
+		addServiceWorker(&names, &nameCount, indexName, fallbackName);
+	}
+	if (exportDir!=NULL) {
+		if (makeDir(exportDir)!=0) {
+			perror(exportDir);
+			exit(1);
+		}
+		exportFiles(names, nameCount, exportDir);
+		for (x=0; x<nameCount; x++) free(names[x]);
+		free(names);
+		freeAssets();
+		return 0;
+	}
+
+	order=malloc(nameCount*sizeof(int));
+	filePos=calloc(nameCount, sizeof(long));
+	fileLen=calloc(nameCount, sizeof(long));
+	if (traceFile!=NULL) {
+		readTrace(traceFile, names, nameCount);
+		orderByTrace(order, nameCount);
+	} else {
+		for (x=0; x<nameCount; x++) order[x]=x;
+	}
+
+#ifdef ESPFS_HEATSHRINK
+	if (dictSize>0 && compType==COMPRESS_HEATSHRINK) {
+		writeDictionary(names, nameCount, dictSize, compLvl);
+	}
+#endif
+
+	if (cacheDir!=NULL) {
+		if (makeDir(cacheDir)!=0) {
+			perror(cacheDir);
+			cacheDir=NULL;
+		}
+	}
+#ifdef _SC_NPROCESSORS_ONLN
+	if (jobs==0) {
+		jobs=sysconf(_SC_NPROCESSORS_ONLN);
+	}
+#endif
+	if (jobs>1) {
+		prefetchAll(names, nameCount, compType, compLvl, blockSize);
+	}
+
+	for (x=0; x<nameCount; x++) {
+		snprintf(fileName, sizeof(fileName), "%s", names[order[x]]);
 		//Only include files
-		serr=stat(fileName, &statBuf);
-		if ((serr==0) && S_ISREG(statBuf.st_mode)) {
-			//Strip off './' or '/' madness.
-			realName=fileName;
-			if (fileName[0]=='.') realName++;
-			if (realName[0]=='/') realName++;
-			f=open(fileName, O_RDONLY|O_BINARY);
-			if (f>0) {
+		if (isFile(fileName)) {
+			realName=storedName(fileName);
+			srcName=sourceName(fileName);
+			if (isReadable(fileName)) {
 				char *compName = "unknown";
-				rate=handleFile(f, realName, compType, compLvl, &compName);
-				fprintf(stderr, "%s (%d%%, %s)\n", realName, rate, compName);
-				close(f);
+				pos=findBlob(fileName, realName);
+				if (pos>=0) {
+					//Same contents as a file already stored
+					addAlias(realName, 0, pos);
+				} else {
+					pos=imagePos;
+					rate=handleFile(fileName, realName, compType, compLvl, blockSize, &compName);
+					filePos[order[x]]=pos;
+					fileLen[order[x]]=imagePos-pos;
+					fprintf(stderr, "%s (%d%%, %s)\n", realName, rate, compName);
+				}
+				base=strrchr(srcName, '/');
+				base=(base==NULL)?srcName:base+1;
+				if (indexName!=NULL && strcmp(base, indexName)==0) {
+					//Alias the directory, keeping its trailing slash
+					char c=*base;
+					*base=0;
+					addAlias(srcName, 0, pos);
+					*base=c;
+				}
+				if (fallbackName!=NULL && strcmp(srcName, fallbackName)==0) {
+					addAlias("", FLAG_FALLBACK, pos);
+				}
+				filePolicy(realName, &policy);
+				if (policy.aliases!=NULL) {
+					char *list=strdup(policy.aliases);
+					char *alias;
+					for (alias=strtok(list, ","); alias!=NULL; alias=strtok(NULL, ",")) {
+						while (alias[0]=='/') alias++;
+						addAlias(alias, 0, pos);
+					}
+					free(list);
+				}
 			} else {
 				perror(fileName);
 			}
 		} else {
-			if (serr!=0) {
+			if (stat(fileName, &statBuf)!=0) {
 				perror(fileName);
 			}
 		}
 	}
+	if (traceFile!=NULL) {
+		benchmarkTrace(filePos, fileLen, nameCount);
+	}
+	for (x=0; x<nameCount; x++) free(names[x]);
+	free(names);
+	for (x=0; x<blobCount; x++) {
+		free(blobs[x].path);
+		free(blobs[x].ext);
+	}
+	free(blobs);
+	free(order);
+	free(filePos);
+	free(fileLen);
+	free(trace);
+	freeAssets();
 	finishArchive();
 	return 0;
 }
@@ -0,0 +1,13 @@
+/*! License comments stay */
+/* Line breaks stay where a statement may end at them */
+let a = b
+++c
+function g() {
+	return
+	x
+}
+a = b
+(c)
+i = j
+-k
+var s = 'it\'s', u = "a  b"
@@ -0,0 +1,10 @@
+// A '/' is a regular expression where an operand is expected, a division otherwise
+if (ok) /  x  /.test(s);
+while (i--)
+	/  y  /g.exec(s);
+var half = (a + b) / 2;
+var r = /[/]  a/g, q = x / y / z;
+var t = typeof /  z  /;
+var n = a[0] / 2;
+function f() {}
+/  w  /.test(s);
@@ -0,0 +1,4 @@
+const s = `line
+  ${ a /* } */ + "}" + `in ${ b }` }
+  two`;
+const r = `${ x.replace(/  }  /g, '') }`;
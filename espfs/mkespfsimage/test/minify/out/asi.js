@@ -0,0 +1,10 @@
+/*! License comments stay */
+let a=b
+++c
+function g(){return
+x}
+a=b
+(c)
+i=j
+-k
+var s='it\'s',u="a  b"
\ No newline at end of file
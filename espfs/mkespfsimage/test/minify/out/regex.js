@@ -0,0 +1,3 @@
+if(ok)/  x  /.test(s);while(i--)
+/  y  /g.exec(s);var half=(a+b)/ 2;var r=/[/]  a/g,q=x / y / z;var t=typeof /  z  /;var n=a[0]/ 2;function f(){}
+/  w  /.test(s);
\ No newline at end of file
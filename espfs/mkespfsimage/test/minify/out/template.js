@@ -0,0 +1,3 @@
+const s=`line
+  ${ a /* } */ + "}" + `in ${ b }` }
+  two`;const r=`${ x.replace(/  }  /g, '') }`;
\ No newline at end of file
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs the stages of mkespfsimage over the files of every case in this directory and compares
+# what they make of them with the expected ones: <case>/in holds the files, <case>/out the
+# result and <case>/args (if there) the options to give, -M by default.
+# usage: run.sh path/to/mkespfsimage
+
+TOOL=$1
+DIR=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+FAILED=0
+
+for CASE in "$DIR"/*/; do
+	NAME=$(basename "$CASE")
+	ARGS="-M"
+	if [ -f "$CASE/args" ]; then
+		ARGS=$(cat "$CASE/args")
+	fi
+	if (cd "$CASE/in" && find . -type f | sort | "$TOOL" $ARGS -X "$TMP/$NAME" 2>/dev/null) &&
+			diff -r "$CASE/out" "$TMP/$NAME"; then
+		echo "$NAME: ok"
+	else
+		echo "$NAME: FAILED"
+		FAILED=1
+	fi
+done
+exit $FAILED
@@ -24,6 +24,11 @@
 #include <string.h>
 
 #include "ahttpd/fs.h"
+#include "espfs/espfsdefaults.h"
+
+
+static const char *(*_mimetype)(const char *ext) = NULL;
+
 
 #ifdef CONFIG_AHTTPD_ENABLE_ESPFS
 
@@ -31,6 +36,7 @@
 #include <esp_log.h>
 
 #include <stdbool.h>
+#include <strings.h>
 
 #include "espfs/espfsformat.h"
 #include "espfs/espfs.h"
@@ -43,6 +49,15 @@
 #define CHUNK_SIZE AHTTPD_ESPFS_CHUNK_SIZE
 #endif
 
+/* Inline bodies are read into the chunk buffer */
+#ifndef INLINE_SIZE
+#if defined(AHTTPD_ESPFS_INLINE_SIZE) && AHTTPD_ESPFS_INLINE_SIZE < CHUNK_SIZE
+#define INLINE_SIZE AHTTPD_ESPFS_INLINE_SIZE
+#else
+#define INLINE_SIZE CHUNK_SIZE
+#endif
+#endif
+
 
 static const char* TAG = "ahttpd-fs";
 static bool FS_INITED = false;
@@ -66,6 +81,23 @@ static enum ahttpd_status ahttpd_501(struct ahttpd_request *request) {
 }
 
 
+/* Mounts the asset partition over the built-in image, so the files in it
+   can be updated without a firmware update */
+static void ahttpd_fs_mount_partition(void) {
+#ifdef CONFIG_AHTTPD_ESPFS_PARTITION
+    if (strlen(CONFIG_AHTTPD_ESPFS_PARTITION) == 0) {
+        return;
+    }
+
+    if (espFsMountPartition(1, CONFIG_AHTTPD_ESPFS_PARTITION) !=
+            ESPFS_INIT_RESULT_OK) {
+        ESP_LOGW(TAG, "No espfs image in partition %s, using the built-in one",
+                 CONFIG_AHTTPD_ESPFS_PARTITION);
+    }
+#endif
+}
+
+
 static esp_err_t ahttpd_fs_init(void) {
     EspFsInitResult res;
 
@@ -78,6 +110,7 @@ static esp_err_t ahttpd_fs_init(void) {
     switch (res) {
         case ESPFS_INIT_RESULT_OK:
             FS_INITED = true;
+            ahttpd_fs_mount_partition();
             return ESP_OK;
 
         case ESPFS_INIT_RESULT_NO_IMAGE:
@@ -101,9 +134,263 @@ static esp_err_t ahttpd_fs_init(void) {
 struct _file {
     char *path;
     EspFsFile *file;
+    int remaining;
 };
 
 
+/* Releases the file of a response, also when the connection is dropped
+   before it is sent completely */
+static void ahttpd_fs_close(struct ahttpd_request *request) {
+    struct _file *f = (struct _file *)request->data;
+
+    if (f != NULL) {
+        espFsClose(f->file);
+        free(f->path);
+        free(f);
+    }
+
+    request->data = NULL;
+    request->on_close = NULL;
+}
+
+
+/* Checks an If-None-Match header value against etag using the weak
+   comparison required by RFC 7232 */
+static bool ahttpd_fs_etag_match(const char *value, const char *etag) {
+    size_t etag_len = strlen(etag);
+
+    while (*value != '\0') {
+        const char *end;
+        size_t len;
+
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+
+        if (*value == '*') {
+            return true;
+        }
+
+        if (strncmp(value, "W/", 2) == 0) {
+            value += 2;
+        }
+
+        end = strchr(value, ',');
+        if (end == NULL) {
+            end = value + strlen(value);
+        }
+
+        len = end - value;
+        while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+            len--;
+        }
+
+        if (len == etag_len && strncmp(value, etag, len) == 0) {
+            return true;
+        }
+
+        value = end;
+    }
+
+    return false;
+}
+
+
+/* Derives the ETag of the inflated representation of a gzipped file by
+   dropping the "-gzip" suffix mkespfsimage gives the stored one */
+static const char *ahttpd_fs_identity_etag(const char *etag, char *buf,
+                                           size_t buf_len) {
+    size_t len;
+
+    if (etag == NULL) {
+        return NULL;
+    }
+
+    len = strlen(etag);
+    if (len < 7 || len - 4 > buf_len || strcmp(etag + len - 6, "-gzip\"") != 0) {
+        return NULL;
+    }
+
+    snprintf(buf, buf_len, "%.*s\"", (int)(len - 6), etag);
+    return buf;
+}
+
+
+/* Returns the quality (0-1000) an Accept-Encoding header value gives
+   coding, a missing header only accepting identity */
+static int ahttpd_fs_accept_q(const char *value, const char *coding) {
+    size_t coding_len = strlen(coding);
+    bool identity = strcmp(coding, "identity") == 0;
+    int match = -1;
+    int star = -1;
+
+    if (value == NULL) {
+        return identity ? 1000 : 0;
+    }
+
+    while (*value != '\0') {
+        const char *name;
+        size_t len;
+        int q = 1000;
+
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+
+        name = value;
+        while (*value != '\0' && *value != ',' && *value != ';' &&
+                *value != ' ' && *value != '\t') {
+            value++;
+        }
+        len = value - name;
+
+        while (*value != '\0' && *value != ',') {
+            if (*value == ';') {
+                value++;
+                while (*value == ' ' || *value == '\t') {
+                    value++;
+                }
+
+                if ((*value == 'q' || *value == 'Q') && value[1] == '=') {
+                    int scale = 100;
+
+                    value += 2;
+                    q = (*value == '1') ? 1000 : 0;
+                    if (*value == '0' || *value == '1') {
+                        value++;
+                    }
+
+                    if (*value == '.') {
+                        value++;
+                        while (*value >= '0' && *value <= '9') {
+                            if (q < 1000) {
+                                q += (*value - '0') * scale;
+                            }
+                            scale /= 10;
+                            value++;
+                        }
+                    }
+                }
+                continue;
+            }
+            value++;
+        }
+
+        if (len == coding_len && strncasecmp(name, coding, len) == 0) {
+            match = q;
+        } else if (len == 1 && *name == '*') {
+            star = q;
+        }
+    }
+
+    if (match >= 0) {
+        return match;
+    }
+
+    if (star >= 0) {
+        return star;
+    }
+
+    return identity ? 1000 : 0;
+}
+
+
+/* Whether a missing url should get the image's fallback file (the page of a
+   single page app), which is only the case for urls without an extension in
+   their last segment; a missing script or image still gets a 404 */
+static bool ahttpd_fs_navigation(const char *url) {
+    const char *segment = strrchr(url, '/');
+
+    if (segment == NULL) {
+        segment = url;
+    }
+
+    return strchr(segment, '.') == NULL;
+}
+
+
+/* Returns the content-coding a file with flags is served with */
+static const char *ahttpd_fs_coding(int flags) {
+    if (flags & FLAG_GZIP) {
+        return "gzip";
+    }
+
+    if (flags & FLAG_BROTLI) {
+        return "br";
+    }
+
+    return "identity";
+}
+
+
+/* Parses a single "bytes=" Range header value against a representation of
+   size bytes. Returns 1 and sets start and end (inclusive) for a satisfiable
+   range, -1 for an unsatisfiable one and 0 if the header is to be ignored */
+static int ahttpd_fs_range(const char *value, int size, int *start,
+                           int *end) {
+    char *p;
+    long first;
+    long last;
+
+    /* Multiple ranges would need a multipart/byteranges body,
+       RFC 7233 allows ignoring the header instead */
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return 0;
+    }
+
+    value += 6;
+    while (*value == ' ') {
+        value++;
+    }
+
+    if (*value == '-') {
+        last = strtol(value + 1, &p, 10);
+        if (p == value + 1 || *p != '\0') {
+            return 0;
+        }
+
+        if (last <= 0 || size == 0) {
+            return -1;
+        }
+
+        if (last > size) {
+            last = size;
+        }
+
+        *start = size - last;
+        *end = size - 1;
+        return 1;
+    }
+
+    first = strtol(value, &p, 10);
+    if (p == value || *p != '-') {
+        return 0;
+    }
+
+    value = p + 1;
+    if (*value == '\0') {
+        last = size - 1;
+    } else {
+        last = strtol(value, &p, 10);
+        if (p == value || *p != '\0' || last < first) {
+            return 0;
+        }
+
+        if (last >= size) {
+            last = size - 1;
+        }
+    }
+
+    if (first >= size) {
+        return -1;
+    }
+
+    *start = first;
+    *end = last;
+    return 1;
+}
+
+
 /* NOTE(jkoelker) This function is basically a port of cgiEspFsHook
                   from libesphttpd covered under the following:
   ----------------------------------------------------------------------------
@@ -115,6 +402,7 @@ struct _file {
  */
 enum ahttpd_status ahttpd_fs_handler(struct ahttpd_request *request) {
     struct _file *f = (struct _file *)request->data;
+    char buf[CHUNK_SIZE];
 
     if (!FS_INITED) {
         esp_err_t err = ahttpd_fs_init();
@@ -126,83 +414,283 @@ enum ahttpd_status ahttpd_fs_handler(struct ahttpd_request *request) {
     }
 
     if (f == NULL) {
-        bool gzipped;
+        bool vary;
         struct ahttpd_header *accept;
+        struct ahttpd_header *if_none_match;
+        struct ahttpd_header *range;
+        struct ahttpd_header *if_range;
         const char *mimetype = NULL;
+        const char *cache_control;
+        const char *encoding;
+        const char *etag;
+        const char *headers;
+        char identity_etag[32];
+        char content_range[48];
+        int ranged = 0;
+        int headers_len = 0;
+        bool inflated = false;
+        int flags;
+        int size;
+        int start;
+        int end;
+        int best = -1;
+        int best_q = 0;
+        int best_size = 0;
 
         EspFsFile *file = espFsOpen((char *)(request->url));
 
+        if (file == NULL && ahttpd_fs_navigation(request->url)) {
+            file = espFsOpenFallback();
+        }
+
         if (file == NULL) {
             return AHTTPD_NOT_FOUND;
         }
 
-        gzipped = (espFsFlags(file) & FLAG_GZIP) == FLAG_GZIP;
-        if (gzipped) {
+        etag = espFsAttr(file, ATTR_ETAG, NULL);
+        flags = espFsFlags(file);
+        encoding = ahttpd_fs_coding(flags);
+
+        vary = (flags & FLAG_GZIP) == FLAG_GZIP ||
+               espFsVariant(file, 1, &flags, &size) == 0;
+        if (vary) {
             accept = ahttpd_find_header(request, "Accept-Encoding");
-            if (accept == NULL || strstr(accept->value, "gzip") == NULL) {
-                espFsClose(file);
-                return ahttpd_501(request);
+
+            /* Serve the smallest encoding the client
+               accepts, preferring the higher q-value
+               between equally sized ones */
+            for (int n = 0; espFsVariant(file, n, &flags, &size) == 0; n++) {
+                int q = ahttpd_fs_accept_q(accept ? accept->value : NULL,
+                                           ahttpd_fs_coding(flags));
+
+                if (q > 0 && (best < 0 || size < best_size ||
+                        (size == best_size && q > best_q))) {
+                    best = n;
+                    best_q = q;
+                    best_size = size;
+                }
+            }
+
+            if (best > 0 && espFsSelectVariant(file, best) == 0) {
+                etag = espFsAttr(file, ATTR_ETAG, NULL);
+                encoding = ahttpd_fs_coding(espFsFlags(file));
+            } else if (best < 0 && strcmp(encoding, "gzip") == 0) {
+                /* Inflate on the fly for clients that can't
+                   take gzip, only failing if that isn't
+                   possible */
+                if (espFsGunzip(file) != 0) {
+                    espFsClose(file);
+                    return ahttpd_501(request);
+                }
+
+                encoding = "identity";
+                inflated = true;
+                etag = ahttpd_fs_identity_etag(etag, identity_etag,
+                                               sizeof(identity_etag));
             }
         }
 
-        size_t url_len = strlen((char *)request->url);
-        if (mimetype == NULL) {
-            char *ext = (char *)request->url + url_len - 1;
-            while (ext != (char *)request->url && *(ext - 1) != '.') {
-                ext--;
+        /* Whatever the manifest said about the file is stored
+           with every entry of it, the defaults only stand
+           in for files it doesn't cover */
+        cache_control = espFsAttr(file, ATTR_CACHE_CONTROL, NULL);
+        if (cache_control == NULL) {
+            cache_control = ESPFS_CACHE_CONTROL;
+        }
+        mimetype = espFsAttr(file, ATTR_MIME, NULL);
+
+        /* The image is immutable, so a matching ETag can be
+           answered from the header alone without ever
+           touching (or decompressing) the file data */
+        if_none_match = ahttpd_find_header(request, "If-None-Match");
+        if (etag != NULL && if_none_match != NULL &&
+                ahttpd_fs_etag_match(if_none_match->value, etag)) {
+            espFsClose(file);
+            ahttpd_start_response(request, 304);
+            ahttpd_send_header(request, "ETag", etag);
+            ahttpd_send_header(request, "Cache-Control", cache_control);
+            if (vary) {
+                ahttpd_send_header(request, "Vary", "Accept-Encoding");
             }
+            ahttpd_end_headers(request);
+            return AHTTPD_DONE;
+        }
 
-            mimetype = ahttpd_fs_mimetype(ext);
+        size = espFsSize(file);
+        start = 0;
+        end = size - 1;
 
-            if (mimetype == NULL) {
-                mimetype = "application/octet-stream";
-            }
+        range = ahttpd_find_header(request, "Range");
+        if_range = ahttpd_find_header(request, "If-Range");
+        if (range != NULL && (if_range == NULL ||
+                (etag != NULL && strcmp(if_range->value, etag) == 0))) {
+            ranged = ahttpd_fs_range(range->value, size, &start, &end);
         }
 
-        f = calloc(1, sizeof(*f));
-        if (f == NULL) {
-            ESP_LOGE(TAG, "OOM while creating file struct for path %s",
-                     request->url);
+        if (ranged < 0) {
+            espFsClose(file);
+            snprintf(content_range, sizeof(content_range), "bytes */%d",
+                     size);
+            ahttpd_start_response(request, 416);
+            ahttpd_send_header(request, "Content-Range", content_range);
+            ahttpd_end_headers(request);
             return AHTTPD_DONE;
         }
 
-        f->path = calloc(url_len + 1, sizeof(*(f->path)));
-        if (f->path == NULL) {
-            ESP_LOGE(TAG, "OOM while creating file url for path %s",
-                     request->url);
-            free(f);
+        if (ranged > 0 && espFsSeek(file, start) != start) {
+            ESP_LOGE(TAG, "Failed to seek to %d in %s", start, request->url);
+            espFsClose(file);
             return AHTTPD_DONE;
         }
 
-        snprintf(f->path, url_len + 1, "%s", request->url);
-        f->file = file;
-        request->data = f;
+        /* Small bodies go out together with the headers,
+           so the response is done in this call without
+           allocating any state for it */
+        if (end - start + 1 > INLINE_SIZE) {
+            size_t url_len = strlen((char *)request->url);
 
-        ahttpd_start_response(request, 200);
-        ahttpd_send_header(request, "Content-Type", mimetype);
-        ahttpd_send_header(request, "Cache-Control",
-                           "max-age=3600, must-revalidate");
+            f = calloc(1, sizeof(*f));
+            if (f == NULL) {
+                ESP_LOGE(TAG, "OOM while creating file struct for path %s",
+                         request->url);
+                espFsClose(file);
+                return AHTTPD_DONE;
+            }
+
+            f->path = calloc(url_len + 1, sizeof(*(f->path)));
+            if (f->path == NULL) {
+                ESP_LOGE(TAG, "OOM while creating file url for path %s",
+                         request->url);
+                espFsClose(file);
+                free(f);
+                return AHTTPD_DONE;
+            }
 
-        if (gzipped) {
-            ahttpd_send_header(request, "Content-Encoding", "gzip");
+            snprintf(f->path, url_len + 1, "%s", request->url);
+            f->file = file;
+            f->remaining = end - start + 1;
+            request->data = f;
+            request->on_close = ahttpd_fs_close;
+        }
+
+        /* A full response of the stored data can go out as
+           the header block mkespfsimage baked for it, in
+           a single write straight from the image. It
+           carries mkespfsimage's idea of the mimetype, so
+           not when a handler overrides that, unless the
+           manifest set it */
+        headers = espFsAttr(file, ATTR_HEADERS, &headers_len);
+        if (headers != NULL && !ranged && !inflated &&
+                (_mimetype == NULL || mimetype != NULL)) {
+            ahttpd_send(request, headers, headers_len);
+        } else {
+            if (mimetype == NULL) {
+                /* Go by the name of the file that is served,
+                   the url may have been an alias of it */
+                const char *name = espFsName(file);
+                const char *ext = name + strlen(name);
+                while (ext != name && *(ext - 1) != '.') {
+                    ext--;
+                }
+
+                mimetype = ahttpd_fs_mimetype(ext);
+
+                if (mimetype == NULL) {
+                    mimetype = "application/octet-stream";
+                }
+            }
+
+            ahttpd_start_response(request, ranged ? 206 : 200);
+            ahttpd_send_header(request, "Content-Type", mimetype);
+            ahttpd_send_header(request, "Cache-Control", cache_control);
+            ahttpd_send_header(request, "Accept-Ranges", "bytes");
+
+            if (ranged) {
+                snprintf(content_range, sizeof(content_range),
+                         "bytes %d-%d/%d", start, end, size);
+                ahttpd_send_header(request, "Content-Range", content_range);
+            }
+
+            if (etag != NULL) {
+                ahttpd_send_header(request, "ETag", etag);
+            }
+
+            if (strcmp(encoding, "identity") != 0) {
+                ahttpd_send_header(request, "Content-Encoding", encoding);
+            }
+
+            if (vary) {
+                ahttpd_send_header(request, "Vary", "Accept-Encoding");
+            }
         }
 
         ahttpd_end_headers(request);
+
+        if (f != NULL) {
+            return AHTTPD_MORE;
+        }
+
+        int len = espFsRead(file, buf, end - start + 1);
+        if (len > 0) {
+            ESP_LOGD(TAG, "Sending %d from file %s inline", len, request->url);
+            ahttpd_send(request, buf, len);
+        }
+
+        espFsClose(file);
+        return AHTTPD_DONE;
+    }
+
+
+    int len = CHUNK_SIZE;
+    if (len > f->remaining) {
+        len = f->remaining;
+    }
+
+    if (len > 0) {
+        len = espFsRead(f->file, buf, len);
+    }
+
+    if (len > 0) {
+        ESP_LOGD(TAG, "Sending %d from file %s", len, f->path);
+        f->remaining -= len;
+        ahttpd_send(request, buf, len);
         return AHTTPD_MORE;
     }
 
+    ahttpd_fs_close(request);
+    return AHTTPD_DONE;
+}
+
+
+/* Streams the files espfs recorded opening as "<ms> <name>" lines, the
+   trace mkespfsimage -t lays out the next image by */
+enum ahttpd_status ahttpd_fs_trace_handler(struct ahttpd_request *request) {
+    uint32_t *pos = (uint32_t *)request->data;
     char buf[CHUNK_SIZE];
 
-    int len = espFsRead(f->file, buf, CHUNK_SIZE);
+    if (pos == NULL) {
+        pos = calloc(1, sizeof(*pos));
+        if (pos == NULL) {
+            ESP_LOGE(TAG, "Out of memory serving the espfs trace");
+            return AHTTPD_DONE;
+        }
+
+        request->data = pos;
+        request->free_data = 1;
+
+        ahttpd_start_response(request, 200);
+        ahttpd_send_header(request, "Content-Type", "text/plain");
+        ahttpd_send_header(request, "Cache-Control", "no-store");
+        ahttpd_end_headers(request);
+        return AHTTPD_MORE;
+    }
+
+    int len = espFsTraceRead(pos, buf, sizeof(buf));
     if (len > 0) {
-        ESP_LOGD(TAG, "Sending %d from file %s", len, f->path);
         ahttpd_send(request, buf, len);
         return AHTTPD_MORE;
     }
 
-    espFsClose(f->file);
-    free(f->path);
-    free(f);
     return AHTTPD_DONE;
 }
 
@@ -216,32 +704,6 @@ void ahttpd_fs_501_handler(
 #endif /* CONFIG_AHTTPD_ENABLE_ESPFS */
 
 
-struct mime_map {
-    const char *ext;
-    const char *mime;
-};
-
-
-static const char *(*_mimetype)(const char *ext) = NULL;
-static const struct mime_map mimetypes[] = {
-    {"html", "text/html"},
-    {"htm", "text/html"},
-    {"css", "text/css"},
-    {"js", "text/javascript"},
-    {"txt", "text/plain"},
-    {"jpg", "image/jpeg"},
-    {"jpeg", "image/jpeg"},
-    {"png", "image/png"},
-    {"svg", "image/svg+xml"},
-    {"xml", "text/xml"},
-    {"json", "application/json"},
-    {"eot", "application/vnd.ms-fontobject"},
-    {"ttf", "application/font-sfnt"},
-    {"woff", "application/font-woff"},
-    {"woff2", "application/font-woff2"},
-};
-
-
 void ahttpd_fs_mimetype_handler(const char *(*handler)(const char *ext)) {
     _mimetype = handler;
 }
@@ -258,9 +720,9 @@ const char *ahttpd_fs_mimetype(const char *ext) {
         }
     }
 
-    for (size_t i = 0; i < (sizeof(mimetypes) / sizeof(*mimetypes)); i++) {
-        if (strcasecmp(mimetypes[i].ext, ext) == 0) {
-            return mimetypes[i].mime;
+    for (size_t i = 0; i < (sizeof(espFsMimeTypes) / sizeof(*espFsMimeTypes)); i++) {
+        if (strcasecmp(espFsMimeTypes[i].ext, ext) == 0) {
+            return espFsMimeTypes[i].mime;
         }
     }
 